@@ -0,0 +1,1220 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for pinning threads to CPUs
+#endif
+#include "chacha20.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef CHACHA20_NO_THREADS
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Copyright(C) 2025 Shivashish Das. Licensed under the MIT License
+
+/* Benchmarks for chacha20.c. Build and run with
+ *
+ *   cc -O2 -o bench bench.c chacha20.c -lpthread
+ *   ./bench <mode> [options]
+ *
+ * Modes:
+ *   fused [max]  single pass ChaCha20Poly1305Seal() against ChaCha20Encrypt()
+ *                followed by a separate Poly1305 pass, from 1 MiB up to max
+ *                bytes (default 1 GiB)
+ *   outofplace [max]
+ *                ChaCha20EncryptTo() against memcpy() followed by
+ *                ChaCha20Encrypt() on the copy, from 64 MiB up to max bytes
+ *                (default 4 GiB, needs twice that much memory)
+ *   multibuffer [count]
+ *                count messages of 64 to 512 bytes (default 65536), each with
+ *                its own key and nonce, encrypted one ChaCha20Encrypt() call
+ *                at a time and through the multi-buffer manager, against
+ *                ChaCha20Encrypt() of a single buffer of the same total size
+ *   batch [count]
+ *                count messages of 32 to 512 bytes (default 65536)
+ *                authenticated with one Poly1305() call each against
+ *                Poly1305Batch(), and sealed with one ChaCha20Poly1305Seal()
+ *                call each against ChaCha20Poly1305SealBatch()
+ *   sizes [max] [samples] [json file]
+ *                Encrypt(), Poly1305() and ChaCha20Poly1305Seal() in core
+ *                cycles per byte and GB/s on every kernel the CPU supports,
+ *                for sizes from 1 byte up to max (default 1 GiB) in steps of
+ *                4. Each figure is the median of samples (default 7) timed
+ *                runs after a warm-up. The results also go to json file as
+ *                JSON if one is given, "-" is stdout.
+ *   imix [mix] [packets]
+ *                per-packet Encrypt() and ChaCha20Poly1305Seal() of packets
+ *                (default 100000) whose sizes follow mix, on every kernel,
+ *                reporting packets/s, bytes/s and latency percentiles. mix
+ *                is "imix" (the default, 7:4:1 packets of 40, 576 and 1500
+ *                bytes) or a histogram file with one "size weight" pair
+ *                per line, # starts a comment
+ *   threads [max] [size] [numa]
+ *                1 to max threads (default one per online CPU), each pinned
+ *                to its own CPU, calling Encrypt() and ChaCha20Poly1305Seal()
+ *                on size byte messages (default 1024) for a quarter second.
+ *                Each thread either has private buffers, or all of them
+ *                share one array of buffers and one array of counters and
+ *                tags. Reports the total GB/s, the scaling against one
+ *                thread, p50/p99/p99.9 latency and the core clock, and flags
+ *                false sharing and throttling. With numa the threads are
+ *                spread over the NUMA nodes round robin, private buffers are
+ *                always first touched by the thread that uses them
+ *   roofline [max] [samples]
+ *                in-place Encrypt(), out-of-place ChaCha20EncryptTo() and
+ *                ChaCha20Poly1305Seal() against memory passes with the same
+ *                traffic (an in-place XOR, memcpy() and memset() for
+ *                reference) from 4 KiB up to max bytes (default 1 GiB) in
+ *                steps of 4, through L1, L2, the last level cache and DRAM.
+ *                For every kernel it reports the fraction of the roofline
+ *                reached, the roofline being the lower of the memory pass
+ *                and the best speed of the op in any cache level, and
+ *                whether the memory or the computation is the limit
+ *   parallel [threads] [size]
+ *                Poly1305Parallel() and ChaCha20Poly1305SealParallel() of a
+ *                size byte buffer (default 256 MiB) on 1 up to threads
+ *                threads (default 8), with the speedup over one thread
+ */
+
+static const uint8_t key[32] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+    14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+    32 };
+static const uint8_t nonce[12] = { 0, 0, 0, 9, 0, 0, 0, 0x4a };
+static const uint8_t aad[12] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2,
+    0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Number of repetitions that keeps each measurement around a quarter second.
+ * Always even, so after encrypting a buffer in place that many times it is
+ * back to the plaintext. */
+static int Repetitions(const uint64_t size) {
+    uint64_t reps = (256ULL << 20) / size;
+    return (reps < 2) ? 2 : (int)(reps & ~1ULL);
+}
+
+static uint8_t* Buffer(const uint64_t size) {
+    uint8_t* buf = malloc(size);
+    if (buf == NULL) {
+        printf("Cannot allocate %llu bytes\n", (unsigned long long)size);
+        exit(1);
+    }
+
+    // Touch every page so page faults are not part of the first measurement
+    memset(buf, 0x5a, size);
+    return buf;
+}
+
+/* The kernels of chacha20.c, for the modes that compare them. NextKernel()
+ * makes the next one after kernels[*k - 1] that the CPU supports active and
+ * returns its name, or returns NULL once there is none left. */
+static const char* const kernels[] = { "scalar", "sse2", "ssse3", "avx2",
+    "avx512" };
+
+static const char* NextKernel(int* k) {
+    while (*k < (int)(sizeof(kernels) / sizeof(kernels[0]))) {
+        const char* name = kernels[(*k)++];
+        if (ChaCha20SetKernel(name) == 0)
+            return name;
+    }
+
+    return NULL;
+}
+
+/* Time stamp counter, or nanoseconds where there is none. It ticks at a
+ * fixed rate, so the ticks are turned into core cycles with the ratio that
+ * CoreRatio() measures. */
+static uint64_t Ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)(Now() * 1e9);
+#endif
+}
+
+// Ticks per second, measured against the monotonic clock
+static double TickRate(void) {
+    static double rate = 0;
+    if (rate == 0) {
+        double t = Now();
+        uint64_t ticks = Ticks();
+        while (Now() - t < 0.05)
+            ;
+        rate = (Ticks() - ticks) / (Now() - t);
+    }
+    return rate;
+}
+
+/* Ticks per core cycle. A chain of dependent additions takes one cycle per
+ * addition at whatever clock the core runs right now, turbo or throttled,
+ * so timing it gives the current ratio of the two clocks. The empty asm
+ * statements keep the compiler from folding the chain. Interrupts only
+ * ever make a run slower, so the fastest of a few short runs is kept. */
+static double CoreRatio(void) {
+    enum { LOOPS = 1 << 15 };
+    uint64_t x = 0, best = ~0ULL;
+    for (int run = 0; run < 8; run++) {
+        uint64_t t = Ticks();
+        for (uint64_t i = 0; i < LOOPS; i++) {
+            for (int j = 0; j < 8; j++) {
+                x += i;
+                __asm__ __volatile__("" : "+r"(x));
+            }
+        }
+        t = Ticks() - t;
+        best = (t < best) ? t : best;
+    }
+    __asm__ __volatile__("" : : "r"(x));
+    return (double)best / (8.0 * LOOPS);
+}
+
+static int CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double Median(double* v, const int n) {
+    qsort(v, n, sizeof(*v), CompareDoubles);
+    return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* CoreRatio() over a window of about 20 ms: the median of 21 runs, which
+ * a short dip or step of the clock does not move. */
+static double ClockRatio(void) {
+    double r[21];
+    for (int i = 0; i < 21; i++)
+        r[i] = CoreRatio();
+    return Median(r, 21);
+}
+
+/* How far ClockRatio() moves between back to back runs on this machine
+ * while nothing else changes, as a fraction: twice the spread of the
+ * middle 7 of 9 runs, and at least 5%. A drift below this is measurement
+ * noise or the odd small step of the clock (on some virtual machines it
+ * moves by a few percent even when idle) and is not reported. */
+static double DriftTolerance(void) {
+    double r[9];
+    for (int i = 0; i < 9; i++)
+        r[i] = ClockRatio();
+
+    double median = Median(r, 9);
+    double spread = 2 * (r[7] - r[1]) / median;
+    return (spread > 0.05) ? spread : 0.05;
+}
+
+typedef void (*BenchFn)(uint8_t* buf, const uint64_t size);
+
+typedef struct Timing {
+    double ticks;   // per call
+    double seconds; // per call
+} Timing;
+
+/* Median of samples timed runs of fn. Every sample repeats fn often enough
+ * to last about a millisecond, so the clock reads do not matter for small
+ * sizes. */
+static Timing Measure(BenchFn fn, uint8_t* buf, const uint64_t size,
+        const int samples) {
+    double ticks[64];
+    const int n = (samples > 64) ? 64 : (samples < 1) ? 1 : samples;
+
+    // Warm up caches, branch predictors and the core clock for 10 ms
+    uint64_t reps = 0, start = Ticks(), warm = (uint64_t)(TickRate() / 100);
+    do {
+        fn(buf, size);
+        reps++;
+    } while (Ticks() - start < warm);
+    reps = reps * (uint64_t)(TickRate() / 1000) / (Ticks() - start);
+    reps = (reps < 1) ? 1 : reps;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t t = Ticks();
+        for (uint64_t j = 0; j < reps; j++)
+            fn(buf, size);
+        ticks[i] = (double)(Ticks() - t) / reps;
+    }
+
+    Timing timing;
+    timing.ticks = Median(ticks, n);
+    timing.seconds = timing.ticks / TickRate();
+    return timing;
+}
+
+/* The straightforward AEAD on top of the public API: encrypt the whole
+ * buffer, then authenticate the whole ciphertext in a second pass. */
+static void TwoPassSeal(uint8_t* data, const uint64_t size, uint8_t tag[16]) {
+    static const uint8_t zeros[16] = { 0 };
+    uint8_t otk[32] = { 0 }, lengths[16];
+    uint64_t aad_size = sizeof(aad);
+    memcpy(lengths, &aad_size, 8);
+    memcpy(lengths + 8, &size, 8);
+
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    ChaCha20SetCounter(&ctx, 0);
+    ChaCha20Encrypt(&ctx, otk, sizeof(otk));
+    ChaCha20SetCounter(&ctx, 1);
+    ChaCha20Encrypt(&ctx, data, size);
+
+    Poly1305Context mac;
+    Poly1305Init(&mac, otk);
+    Poly1305Update(&mac, aad, sizeof(aad));
+    Poly1305Update(&mac, zeros, (16 - sizeof(aad) % 16) % 16);
+    Poly1305Update(&mac, data, size);
+    Poly1305Update(&mac, zeros, (16 - size % 16) % 16);
+    Poly1305Update(&mac, lengths, 16);
+    Poly1305Final(&mac, tag);
+}
+
+static int BenchFused(int argc, char** argv) {
+    uint64_t max = (argc > 0) ? strtoull(argv[0], NULL, 0) : 1ULL << 30;
+
+    printf("kernel: %s\n", ChaCha20KernelName());
+    printf("%12s %14s %14s %8s\n", "bytes", "two-pass GB/s", "fused GB/s",
+            "speedup");
+    for (uint64_t size = 1 << 20; size <= max; size *= 4) {
+        uint8_t* buf = Buffer(size);
+        uint8_t tag[16], check[16];
+        int reps = Repetitions(size);
+
+        double t = Now();
+        for (int i = 0; i < reps; i++)
+            TwoPassSeal(buf, size, check);
+        double two_pass = (Now() - t) / reps;
+
+        t = Now();
+        for (int i = 0; i < reps; i++)
+            ChaCha20Poly1305Seal(buf, size, aad, sizeof(aad), key, nonce, tag);
+        double fused = (Now() - t) / reps;
+
+        /* Both sealed the buffer an even number of times, so their last runs
+         * sealed the same plaintext and must agree. */
+        if (memcmp(tag, check, 16) != 0) {
+            printf("Fused and two-pass tags differ at %llu bytes\n",
+                    (unsigned long long)size);
+            return 1;
+        }
+
+        printf("%12llu %14.2f %14.2f %7.2fx\n", (unsigned long long)size,
+                size / two_pass / 1e9, size / fused / 1e9, two_pass / fused);
+        free(buf);
+    }
+
+    return 0;
+}
+
+/* Both ways leave the same ciphertext in dst. Only its ends are compared,
+ * keeping a copy of the whole output would double the memory needed. */
+static int BenchOutOfPlace(int argc, char** argv) {
+    uint64_t max = (argc > 0) ? strtoull(argv[0], NULL, 0) : 4ULL << 30;
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+
+    printf("kernel: %s, CHACHA20_NT_MIN: %llu (0 = last level cache size)\n",
+            ChaCha20KernelName(), (unsigned long long)CHACHA20_NT_MIN);
+    printf("%12s %18s %18s %8s\n", "bytes", "memcpy+enc GB/s",
+            "EncryptTo GB/s", "speedup");
+    for (uint64_t size = 64ULL << 20; size <= max; size *= 2) {
+        uint8_t* src = Buffer(size);
+        uint8_t* dst = Buffer(size);
+        uint8_t ends[2][2][4096];
+        int reps = Repetitions(size);
+
+        double t = Now();
+        for (int i = 0; i < reps; i++) {
+            memcpy(dst, src, size);
+            ChaCha20Encrypt(&ctx, dst, size);
+        }
+        double copy = (Now() - t) / reps;
+        memcpy(ends[0][0], dst, 4096);
+        memcpy(ends[0][1], dst + size - 4096, 4096);
+
+        t = Now();
+        for (int i = 0; i < reps; i++)
+            ChaCha20EncryptTo(&ctx, dst, src, size);
+        double to = (Now() - t) / reps;
+        memcpy(ends[1][0], dst, 4096);
+        memcpy(ends[1][1], dst + size - 4096, 4096);
+
+        if (memcmp(ends[0], ends[1], sizeof(ends[0])) != 0) {
+            printf("Outputs differ at %llu bytes\n", (unsigned long long)size);
+            return 1;
+        }
+
+        printf("%12llu %18.2f %18.2f %7.2fx\n", (unsigned long long)size,
+                size / copy / 1e9, size / to / 1e9, copy / to);
+        free(src);
+        free(dst);
+    }
+
+    return 0;
+}
+
+static int BenchMultiBuffer(int argc, char** argv) {
+    int count = (argc > 0) ? atoi(argv[0]) : 65536;
+    ChaCha20Context* ctx = malloc(count * sizeof(*ctx));
+    ChaCha20Job* jobs = malloc(count * sizeof(*jobs));
+    uint8_t** msgs = malloc(count * sizeof(*msgs));
+    uint8_t* check = Buffer(512);
+    uint64_t total = 0;
+
+    printf("kernel: %s\n", ChaCha20KernelName());
+    printf("%6s %14s %14s %14s %8s\n", "bytes", "per-call GB/s",
+            "manager GB/s", "bulk GB/s", "speedup");
+    for (int max = 64; max <= 512; max *= 2) {
+        total = 0;
+        for (int i = 0; i < count; i++) {
+            uint8_t k[32], n[12] = { 0 };
+            memcpy(k, key, 32);
+            memcpy(k, &i, sizeof(i));
+            memcpy(n, &i, sizeof(i));
+            ChaCha20Init(&ctx[i], k, n);
+
+            // Sizes vary between half the maximum and the maximum
+            jobs[i].size = max / 2 + (i * 37) % (max / 2 + 1);
+            msgs[i] = Buffer(jobs[i].size);
+            total += jobs[i].size;
+        }
+
+        int reps = Repetitions(total);
+        double t = Now();
+        for (int r = 0; r < reps; r++) {
+            for (int i = 0; i < count; i++)
+                ChaCha20Encrypt(&ctx[i], msgs[i], jobs[i].size);
+        }
+        double single = (Now() - t) / reps;
+
+        t = Now();
+        for (int r = 0; r < reps; r++) {
+            ChaCha20Manager mgr;
+            ChaCha20ManagerInit(&mgr);
+            for (int i = 0; i < count; i++) {
+                jobs[i].ctx = &ctx[i];
+                jobs[i].data = msgs[i];
+                ChaCha20ManagerSubmit(&mgr, &jobs[i]);
+            }
+            while (ChaCha20ManagerFlush(&mgr) != NULL)
+                ;
+        }
+        double managed = (Now() - t) / reps;
+
+        // Both encrypted every message an even number of times
+        for (int i = 0; i < count; i++) {
+            memset(check, 0x5a, jobs[i].size);
+            if (memcmp(msgs[i], check, jobs[i].size) != 0) {
+                printf("Message %d was not encrypted correctly\n", i);
+                return 1;
+            }
+        }
+
+        uint8_t* bulk_buf = Buffer(total);
+        t = Now();
+        for (int r = 0; r < reps; r++)
+            ChaCha20Encrypt(&ctx[0], bulk_buf, total);
+        double bulk = (Now() - t) / reps;
+
+        printf("%6d %14.2f %14.2f %14.2f %7.2fx\n", max, total / single / 1e9,
+                total / managed / 1e9, total / bulk / 1e9, single / managed);
+        for (int i = 0; i < count; i++)
+            free(msgs[i]);
+        free(bulk_buf);
+    }
+
+    free(ctx);
+    free(jobs);
+    free(msgs);
+    free(check);
+    return 0;
+}
+
+static int BenchBatch(int argc, char** argv) {
+    int count = (argc > 0) ? atoi(argv[0]) : 65536;
+    const void** msgs = malloc(count * sizeof(*msgs));
+    uint64_t* sizes = malloc(count * sizeof(*sizes));
+    uint8_t* keys = Buffer(32 * (uint64_t)count);
+    uint8_t* tags = Buffer(16 * (uint64_t)count);
+    ChaCha20Poly1305Job* jobs = malloc(count * sizeof(*jobs));
+
+    printf("kernel: %s\n", ChaCha20KernelName());
+    printf("%6s %12s %12s %8s %12s %12s %8s\n", "bytes", "MAC GB/s",
+            "batch GB/s", "speedup", "seal GB/s", "batch GB/s", "speedup");
+    for (int max = 64; max <= 512; max *= 2) {
+        uint64_t total = 0;
+        for (int i = 0; i < count; i++) {
+            sizes[i] = max / 2 + (i * 37) % (max / 2 + 1);
+            msgs[i] = Buffer(sizes[i]);
+            total += sizes[i];
+            keys[32 * i] = (uint8_t)i;
+
+            jobs[i].data = (void*)msgs[i];
+            jobs[i].size = sizes[i];
+            jobs[i].aad = aad;
+            jobs[i].aad_size = sizeof(aad);
+            jobs[i].key = keys + 32 * i;
+            jobs[i].nonce = nonce;
+        }
+
+        int reps = Repetitions(total);
+        double t = Now();
+        for (int r = 0; r < reps; r++) {
+            for (int i = 0; i < count; i++)
+                Poly1305(tags + 16 * i, msgs[i], sizes[i], keys + 32 * i);
+        }
+        double single = (Now() - t) / reps;
+
+        t = Now();
+        for (int r = 0; r < reps; r++)
+            Poly1305Batch(tags, msgs, sizes, keys, count);
+        double batch = (Now() - t) / reps;
+
+        t = Now();
+        for (int r = 0; r < reps; r++) {
+            for (int i = 0; i < count; i++)
+                ChaCha20Poly1305Seal(jobs[i].data, sizes[i], aad, sizeof(aad),
+                        jobs[i].key, nonce, jobs[i].tag);
+        }
+        double seal = (Now() - t) / reps;
+
+        t = Now();
+        for (int r = 0; r < reps; r++)
+            ChaCha20Poly1305SealBatch(jobs, count);
+        double seal_batch = (Now() - t) / reps;
+
+        // Both sealed every message an even number of times
+        for (int i = 0; i < count; i++) {
+            uint8_t tag[16];
+            memcpy(tag, jobs[i].tag, 16);
+            if (ChaCha20Poly1305Open(jobs[i].data, sizes[i], aad, sizeof(aad),
+                        jobs[i].key, nonce, tag) != 0) {
+                printf("Message %d was not sealed correctly\n", i);
+                return 1;
+            }
+        }
+
+        printf("%6d %12.2f %12.2f %7.2fx %12.2f %12.2f %7.2fx\n", max,
+                total / single / 1e9, total / batch / 1e9, single / batch,
+                total / seal / 1e9, total / seal_batch / 1e9,
+                seal / seal_batch);
+        for (int i = 0; i < count; i++)
+            free((void*)msgs[i]);
+    }
+
+    free(msgs);
+    free(sizes);
+    free(keys);
+    free(tags);
+    free(jobs);
+    return 0;
+}
+
+static void EncryptOp(uint8_t* buf, const uint64_t size) {
+    Encrypt(buf, size, key, nonce);
+}
+
+static void Poly1305Op(uint8_t* buf, const uint64_t size) {
+    uint8_t tag[16];
+    Poly1305(tag, buf, size, key);
+    __asm__ __volatile__("" : : "r"(tag) : "memory");
+}
+
+static void SealOp(uint8_t* buf, const uint64_t size) {
+    uint8_t tag[16];
+    ChaCha20Poly1305Seal(buf, size, aad, sizeof(aad), key, nonce, tag);
+    __asm__ __volatile__("" : : "r"(tag) : "memory");
+}
+
+/* Ticks are turned into core cycles with the clock ratio measured over a
+ * long window before and after the sweep of each kernel. If the two differ
+ * by more than DriftTolerance() the clock changed during the sweep (turbo,
+ * throttling) and the cycle figures of that kernel are marked. */
+static int BenchSizes(int argc, char** argv) {
+    static const char* names[] = { "encrypt", "poly1305", "aead" };
+    static const BenchFn ops[] = { EncryptOp, Poly1305Op, SealOp };
+    uint64_t max = (argc > 0) ? strtoull(argv[0], NULL, 0) : 1ULL << 30;
+    int samples = (argc > 1) ? atoi(argv[1]) : 7;
+    FILE* json = NULL;
+    if (argc > 2)
+        json = (strcmp(argv[2], "-") == 0) ? stdout : fopen(argv[2], "w");
+    if (argc > 2 && json == NULL) {
+        printf("Cannot open %s\n", argv[2]);
+        return 1;
+    }
+
+    // With the JSON on stdout the table goes to stderr
+    FILE* out = (json == stdout) ? stderr : stdout;
+    const char* best = ChaCha20KernelName();
+    uint8_t* buf = Buffer((max > 0) ? max : 1);
+    Timing timings[32][3];
+    int first = 1;
+    double tolerance = DriftTolerance();
+    if (json != NULL) {
+        fprintf(json, "{\n  \"tick_ghz\": %.4f,\n  \"samples\": %d,\n"
+                "  \"drift_tolerance\": %.4f,\n  \"results\": [",
+                TickRate() / 1e9, samples, tolerance);
+    }
+
+    int k = 0;
+    for (const char* kernel; (kernel = NextKernel(&k)) != NULL;) {
+        int n = 0;
+        double before = ClockRatio();
+        for (uint64_t size = 1; size <= max && n < 32; size *= 4, n++) {
+            for (int op = 0; op < 3; op++)
+                timings[n][op] = Measure(ops[op], buf, size, samples);
+        }
+        double after = ClockRatio();
+        double ratio = (before + after) / 2;
+        double drift = (after > before) ? (after - before) / before :
+            (before - after) / before;
+        const char* mark = (drift > tolerance) ? "*" : "";
+
+        fprintf(out, "kernel: %s (%.2f GHz ticks, %.3f ticks per cycle)\n",
+                kernel, TickRate() / 1e9, ratio);
+        fprintf(out, "%12s %10s %8s %10s %8s %10s %8s\n", "bytes",
+                "enc c/B", "GB/s", "mac c/B", "GB/s", "aead c/B", "GB/s");
+        uint64_t size = 1;
+        for (int i = 0; i < n; i++, size *= 4) {
+            fprintf(out, "%12llu", (unsigned long long)size);
+            for (int op = 0; op < 3; op++) {
+                Timing* t = &timings[i][op];
+                fprintf(out, " %9.2f%1s %8.3f", t->ticks / ratio / size, mark,
+                        size / t->seconds / 1e9);
+                if (json == NULL)
+                    continue;
+
+                fprintf(json, "%s\n    { \"kernel\": \"%s\", \"op\": "
+                        "\"%s\", \"bytes\": %llu, \"cycles_per_byte\": "
+                        "%.4f, \"gb_per_s\": %.4f, \"drift\": %.4f }",
+                        first ? "" : ",", kernel, names[op],
+                        (unsigned long long)size, t->ticks / ratio / size,
+                        size / t->seconds / 1e9, drift);
+                first = 0;
+            }
+            fprintf(out, "\n");
+        }
+        if (drift > tolerance) {
+            fprintf(out, "* the core clock moved by %.1f%% during the sweep, "
+                    "more than the %.1f%% it varies when idle\n",
+                    100 * drift, 100 * tolerance);
+        }
+        fflush(out);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        if (json != stdout)
+            fclose(json);
+    }
+    ChaCha20SetKernel(best);
+    free(buf);
+    return 0;
+}
+
+/* Packet size distribution for the imix mode: sizes[i] is drawn with
+ * probability weights[i] / total. */
+typedef struct Mix {
+    uint64_t sizes[1024];
+    double   weights[1024];
+    double   total;
+    int      bins;
+} Mix;
+
+static int LoadMix(Mix* mix, const char* name) {
+    static const uint64_t imix_sizes[] = { 40, 576, 1500 };
+    static const double imix_weights[] = { 7, 4, 1 };
+    mix->total = 0;
+    mix->bins = 0;
+    if (strcmp(name, "imix") == 0) {
+        for (int i = 0; i < 3; i++) {
+            mix->sizes[i] = imix_sizes[i];
+            mix->weights[i] = imix_weights[i];
+            mix->total += imix_weights[i];
+        }
+        mix->bins = 3;
+        return 0;
+    }
+
+    FILE* f = fopen(name, "r");
+    if (f == NULL) {
+        printf("Cannot open %s\n", name);
+        return -1;
+    }
+
+    char line[256];
+    for (int n = 1; fgets(line, sizeof(line), f) != NULL; n++) {
+        unsigned long long size;
+        double weight;
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = 0;
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        if (sscanf(line, "%llu %lf", &size, &weight) != 2 || weight < 0 ||
+                mix->bins == 1024) {
+            printf("%s:%d: expected \"size weight\"\n", name, n);
+            fclose(f);
+            return -1;
+        }
+        mix->sizes[mix->bins] = size;
+        mix->weights[mix->bins++] = weight;
+        mix->total += weight;
+    }
+
+    fclose(f);
+    if (mix->total <= 0) {
+        printf("%s: no packets in the histogram\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// Next uniform number in [0, 1), xorshift64* so every run sees the same mix
+static double Random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545f4914f6cdd1dULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+// p-th percentile of sorted values, nearest rank
+static double Percentile(const double* sorted, const uint64_t n,
+        const double p) {
+    uint64_t rank = (uint64_t)(p / 100 * n + 0.999999);
+    return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+/* Every packet is en- or decrypted from its own place in one big buffer,
+ * as a gateway would see them arrive, and timed on its own. The time of
+ * the clock reads is measured and taken off the per-packet latencies, the
+ * packet rate comes from the time of the whole run. */
+static int BenchIMIX(int argc, char** argv) {
+    static const char* names[] = { "encrypt", "aead" };
+    static const BenchFn ops[] = { EncryptOp, SealOp };
+    const char* name = (argc > 0) ? argv[0] : "imix";
+    uint64_t count = (argc > 1) ? strtoull(argv[1], NULL, 0) : 100000;
+    static Mix mix;
+    if (LoadMix(&mix, name) != 0 || count == 0)
+        return 1;
+
+    uint64_t* sizes = malloc(count * sizeof(*sizes));
+    uint64_t* offsets = malloc(count * sizeof(*offsets));
+    double* latency = malloc(count * sizeof(*latency));
+    uint64_t total = 0, state = 0x9e3779b97f4a7c15ULL;
+    for (uint64_t i = 0; i < count; i++) {
+        double x = Random(&state) * mix.total;
+        int bin = 0;
+        while (bin < mix.bins - 1 && x >= mix.weights[bin])
+            x -= mix.weights[bin++];
+        sizes[i] = mix.sizes[bin];
+        offsets[i] = total;
+        total += sizes[i];
+    }
+    uint8_t* buf = Buffer((total > 0) ? total : 1);
+
+    // Cost of the two clock reads around a packet
+    double overhead[64];
+    for (int i = 0; i < 64; i++) {
+        uint64_t t = Ticks();
+        overhead[i] = (double)(Ticks() - t);
+    }
+    double clock_ticks = Median(overhead, 64);
+
+    const char* best = ChaCha20KernelName();
+    printf("mix: %s, %llu packets, %.1f bytes on average\n", name,
+            (unsigned long long)count, (double)total / count);
+    printf("%8s %8s %10s %8s %9s %9s %9s %9s\n", "kernel", "op", "Mpkt/s",
+            "GB/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns");
+    int k = 0;
+    for (const char* kernel; (kernel = NextKernel(&k)) != NULL;) {
+        for (int op = 0; op < 2; op++) {
+            // One pass to warm up, then the timed one
+            for (uint64_t i = 0; i < count; i++)
+                ops[op](buf + offsets[i], sizes[i]);
+
+            uint64_t start = Ticks();
+            for (uint64_t i = 0; i < count; i++) {
+                uint64_t t = Ticks();
+                ops[op](buf + offsets[i], sizes[i]);
+                latency[i] = (double)(Ticks() - t) - clock_ticks;
+            }
+            double seconds = (Ticks() - start) / TickRate();
+
+            qsort(latency, count, sizeof(*latency), CompareDoubles);
+            printf("%8s %8s %10.3f %8.3f", kernel, names[op],
+                    count / seconds / 1e6, total / seconds / 1e9);
+            const double percentiles[] = { 50, 90, 99, 99.9 };
+            for (int p = 0; p < 4; p++) {
+                printf(" %9.0f", Percentile(latency, count, percentiles[p]) /
+                        TickRate() * 1e9);
+            }
+            printf("\n");
+        }
+    }
+
+    ChaCha20SetKernel(best);
+    free(buf);
+    free(sizes);
+    free(offsets);
+    free(latency);
+    return 0;
+}
+
+#ifndef CHACHA20_NO_THREADS
+/* What a thread writes on every call. With adjacent layout the slots of all
+ * threads are packed next to each other, so several share a cache line. */
+typedef struct Slot {
+    uint64_t calls;
+    uint8_t  tag[16];
+} Slot;
+
+typedef struct Shared {
+    pthread_barrier_t start;
+    int               stop;
+} Shared;
+
+#define WORKER_SAMPLES 65536
+
+typedef struct Worker {
+    pthread_t thread;
+    Shared*   shared;
+    int       cpu;     // -1 to leave it unpinned
+    int       op;      // 0 Encrypt(), 1 ChaCha20Poly1305Seal()
+    uint8_t*  data;    // NULL for a private buffer
+    uint64_t  size;
+    Slot*     slot;
+    double*   latency; // the last WORKER_SAMPLES calls, in ticks
+    double    ratio;   // CoreRatio() right after the run
+} Worker;
+
+static void* WorkerThread(void* arg) {
+    Worker* w = arg;
+#ifdef __linux__
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    // Touched here first, so the pages come from this thread's NUMA node
+    uint8_t* data = (w->data != NULL) ? w->data : Buffer(w->size);
+    pthread_barrier_wait(&w->shared->start);
+
+    uint64_t calls = 0;
+    while (!__atomic_load_n(&w->shared->stop, __ATOMIC_RELAXED)) {
+        uint64_t t = Ticks();
+        if (w->op == 0) {
+            Encrypt(data, w->size, key, nonce);
+        } else {
+            ChaCha20Poly1305Seal(data, w->size, aad, sizeof(aad), key, nonce,
+                    w->slot->tag);
+        }
+        w->slot->calls++;
+        w->latency[calls++ % WORKER_SAMPLES] = (double)(Ticks() - t);
+    }
+    w->ratio = CoreRatio();
+
+    if (w->data == NULL)
+        free(data);
+    return NULL;
+}
+
+/* CPUs for the threads in the order they are used: the ones this process
+ * may run on, in number order or with numa taking one from each node in
+ * turn. Returns how many, 0 where threads cannot be pinned. */
+static int PinOrder(int* cpus, const int max, const int numa) {
+    int n = 0;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return 0;
+
+    if (numa) {
+        static int nodes[64][CPU_SETSIZE];
+        int counts[64] = { 0 }, count = 0;
+        for (; count < 64; count++) {
+            char path[64];
+            snprintf(path, sizeof(path),
+                    "/sys/devices/system/node/node%d/cpulist", count);
+            FILE* f = fopen(path, "r");
+            if (f == NULL)
+                break;
+
+            // A list of ranges like 0-15,32-47
+            int lo, hi;
+            char sep = ',';
+            while (sep == ',' && fscanf(f, "%d", &lo) == 1) {
+                hi = lo;
+                if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+                    if (fscanf(f, "%d", &hi) != 1 || fscanf(f, "%c", &sep) != 1)
+                        sep = 0;
+                }
+                for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+                    if (CPU_ISSET(c, &allowed))
+                        nodes[count][counts[count]++] = c;
+                }
+            }
+            fclose(f);
+        }
+
+        for (int i = 0, left = 1; left && n < max; i++) {
+            left = 0;
+            for (int node = 0; node < count && n < max; node++) {
+                if (i < counts[node]) {
+                    cpus[n++] = nodes[node][i];
+                    left = 1;
+                }
+            }
+        }
+        if (n > 0)
+            return n;
+    }
+
+    for (int c = 0; c < CPU_SETSIZE && n < max; c++) {
+        if (CPU_ISSET(c, &allowed))
+            cpus[n++] = c;
+    }
+#else
+    (void)cpus;
+    (void)max;
+    (void)numa;
+#endif
+    return n;
+}
+
+typedef struct ThreadRun {
+    double gbps;
+    double ghz;
+    double p50, p99, p999; // ns
+} ThreadRun;
+
+static ThreadRun RunThreads(const int threads, const int op,
+        const int adjacent, const uint64_t size, const int* cpus,
+        const int ncpus) {
+    Shared shared;
+    Worker* workers = calloc(threads, sizeof(*workers));
+    Slot* packed = calloc(threads, sizeof(*packed));
+    uint8_t* shared_data = adjacent ? Buffer(threads * size + 1) : NULL;
+    double* all = malloc((uint64_t)threads * WORKER_SAMPLES * sizeof(*all));
+    shared.stop = 0;
+    pthread_barrier_init(&shared.start, NULL, threads + 1);
+
+    for (int i = 0; i < threads; i++) {
+        Worker* w = &workers[i];
+        w->shared = &shared;
+        w->cpu = (ncpus > 0) ? cpus[i % ncpus] : -1;
+        w->op = op;
+        w->data = adjacent ? shared_data + i * size : NULL;
+        w->size = size;
+        // A private slot gets a cache line of its own
+        w->slot = adjacent ? &packed[i] : aligned_alloc(64, 64);
+        w->slot->calls = 0;
+        w->latency = malloc(WORKER_SAMPLES * sizeof(double));
+        pthread_create(&w->thread, NULL, WorkerThread, w);
+    }
+
+    pthread_barrier_wait(&shared.start);
+    double t = Now();
+    struct timespec quarter = { 0, 250000000 };
+    nanosleep(&quarter, NULL);
+    __atomic_store_n(&shared.stop, 1, __ATOMIC_RELAXED);
+    t = Now() - t;
+
+    ThreadRun run = { 0, 0, 0, 0, 0 };
+    uint64_t calls = 0, n = 0;
+    for (int i = 0; i < threads; i++) {
+        Worker* w = &workers[i];
+        pthread_join(w->thread, NULL);
+        uint64_t c = w->slot->calls;
+        calls += c;
+        run.ghz += TickRate() / w->ratio / 1e9 / threads;
+        for (uint64_t j = 0; j < c && j < WORKER_SAMPLES; j++)
+            all[n++] = w->latency[j];
+
+        free(w->latency);
+        if (!adjacent)
+            free(w->slot);
+    }
+    pthread_barrier_destroy(&shared.start);
+
+    run.gbps = calls * size / t / 1e9;
+    if (n > 0) {
+        qsort(all, n, sizeof(*all), CompareDoubles);
+        run.p50 = Percentile(all, n, 50) / TickRate() * 1e9;
+        run.p99 = Percentile(all, n, 99) / TickRate() * 1e9;
+        run.p999 = Percentile(all, n, 99.9) / TickRate() * 1e9;
+    }
+
+    free(all);
+    free(shared_data);
+    free(packed);
+    free(workers);
+    return run;
+}
+
+/* The single thread figures of each op and layout are the reference for
+ * the scaling and the core clock of the runs with more threads. Adjacent
+ * runs more than 10% below private ones with the same threads are flagged
+ * as false sharing, a core clock 5% below the single thread one as
+ * throttling. */
+static int BenchThreads(int argc, char** argv) {
+    static const char* names[] = { "encrypt", "aead" };
+    static const char* layouts[] = { "private", "adjacent" };
+    int max = (argc > 0) ? atoi(argv[0]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t size = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1024;
+    int numa = argc > 2 && strcmp(argv[2], "numa") == 0;
+    max = (max < 1) ? 1 : max;
+    size = (size < 1) ? 1 : size;
+
+    int* cpus = malloc(max * sizeof(*cpus));
+    int ncpus = PinOrder(cpus, max, numa);
+    ThreadRun one[2][2];
+
+    printf("kernel: %s, %llu bytes, %s\n", ChaCha20KernelName(),
+            (unsigned long long)size, (ncpus == 0) ? "not pinned" :
+            numa ? "pinned round robin over NUMA nodes" : "pinned");
+    printf("%7s %8s %8s %8s %7s %8s %8s %8s %6s  %s\n", "threads", "layout",
+            "op", "GB/s", "scaling", "p50 ns", "p99 ns", "p99.9 ns", "GHz",
+            "flags");
+    for (int threads = 1; threads <= max; threads++) {
+        for (int op = 0; op < 2; op++) {
+            ThreadRun run[2];
+            for (int adjacent = 0; adjacent < 2; adjacent++) {
+                run[adjacent] = RunThreads(threads, op, adjacent, size, cpus,
+                        ncpus);
+                if (threads == 1)
+                    one[op][adjacent] = run[adjacent];
+
+                ThreadRun* r = &run[adjacent];
+                ThreadRun* ref = &one[op][adjacent];
+                printf("%7d %8s %8s %8.3f %6.2fx %8.0f %8.0f %8.0f %6.2f  "
+                        "%s%s\n", threads, layouts[adjacent], names[op],
+                        r->gbps, r->gbps / (threads * ref->gbps), r->p50,
+                        r->p99, r->p999, r->ghz,
+                        (adjacent && r->gbps < 0.9 * run[0].gbps) ?
+                        "false-sharing " : "",
+                        (r->ghz < 0.95 * ref->ghz) ? "throttled" : "");
+                fflush(stdout);
+            }
+        }
+    }
+
+    free(cpus);
+    return 0;
+}
+#endif
+
+// Second buffer of the out-of-place ops in the roofline mode
+static uint8_t* roof_dst;
+static ChaCha20Context roof_ctx;
+
+static void CopyOp(uint8_t* buf, const uint64_t size) {
+    memcpy(roof_dst, buf, size);
+    __asm__ __volatile__("" : : "r"(roof_dst) : "memory");
+}
+
+static void SetOp(uint8_t* buf, const uint64_t size) {
+    memset(buf, 0x5a, size);
+    __asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+/* The cheapest pass that reads and writes every byte in place, as in-place
+ * encryption does, 16 bytes at a time in a vector register. */
+typedef uint64_t XorVec __attribute__((vector_size(16)));
+
+static void XorOp(uint8_t* buf, const uint64_t size) {
+    const XorVec k = { 0x5a5a5a5a5a5a5a5aULL, 0x5a5a5a5a5a5a5a5aULL };
+    uint64_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        XorVec v;
+        memcpy(&v, buf + i, 16);
+        v ^= k;
+        memcpy(buf + i, &v, 16);
+    }
+    for (; i < size; i++)
+        buf[i] ^= 0x5a;
+    __asm__ __volatile__("" : : "r"(buf) : "memory");
+}
+
+static void EncryptToOp(uint8_t* buf, const uint64_t size) {
+    ChaCha20EncryptTo(&roof_ctx, roof_dst, buf, size);
+}
+
+static uint64_t CacheLevel(const int level) {
+    long size = -1;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    if (level == 1)
+        size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+    if (level == 2)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (level == 3)
+        size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    return (size > 0) ? (uint64_t)size : 0;
+}
+
+/* Each op is paired with the memory pass that moves the same bytes: the
+ * in-place ones with XorOp(), ChaCha20EncryptTo() with memcpy(). The
+ * compute ceiling of an op is its best speed over all sizes, which is
+ * where the data sits in a cache. Where the memory pass is slower than
+ * that ceiling the op is memory bound and only less traffic (non-temporal
+ * stores, fewer passes) helps, otherwise more cores do. */
+static int BenchRoofline(int argc, char** argv) {
+    static const char* names[] = { "encrypt", "encto", "aead" };
+    static const BenchFn ops[] = { EncryptOp, EncryptToOp, SealOp };
+    static const BenchFn roofs[] = { XorOp, CopyOp, XorOp };
+    enum { SIZES = 32 };
+    uint64_t max = (argc > 0) ? strtoull(argv[0], NULL, 0) : 1ULL << 30;
+    int samples = (argc > 1) ? atoi(argv[1]) : 5;
+    uint64_t l1 = CacheLevel(1), l2 = CacheLevel(2), l3 = CacheLevel(3);
+    double copy[SIZES], set[SIZES], xor[SIZES], gbps[3][SIZES];
+    uint64_t sizes[SIZES];
+    int n = 0;
+    for (uint64_t size = 4096; size <= max && n < SIZES; size *= 4)
+        sizes[n++] = size;
+    if (n == 0)
+        return 1;
+
+    uint8_t* buf = Buffer(sizes[n - 1]);
+    roof_dst = Buffer(sizes[n - 1]);
+    ChaCha20Init(&roof_ctx, key, nonce);
+
+    printf("L1 %llu KiB, L2 %llu KiB, LLC %llu KiB\n",
+            (unsigned long long)(l1 >> 10), (unsigned long long)(l2 >> 10),
+            (unsigned long long)(l3 >> 10));
+    printf("%12s %5s %11s %11s %11s\n", "bytes", "level", "xor GB/s",
+            "memcpy GB/s", "memset GB/s");
+    for (int i = 0; i < n; i++) {
+        const uint64_t size = sizes[i];
+        xor[i] = size / Measure(XorOp, buf, size, samples).seconds / 1e9;
+        copy[i] = size / Measure(CopyOp, buf, size, samples).seconds / 1e9;
+        set[i] = size / Measure(SetOp, buf, size, samples).seconds / 1e9;
+        printf("%12llu %5s %11.2f %11.2f %11.2f\n", (unsigned long long)size,
+                (size <= l1) ? "L1" : (size <= l2) ? "L2" :
+                (size <= l3) ? "LLC" : "DRAM", xor[i], copy[i], set[i]);
+    }
+
+    const char* best = ChaCha20KernelName();
+    int k = 0;
+    for (const char* kernel; (kernel = NextKernel(&k)) != NULL;) {
+        double peak[3] = { 0, 0, 0 };
+        for (int op = 0; op < 3; op++) {
+            for (int i = 0; i < n; i++) {
+                gbps[op][i] = sizes[i] / Measure(ops[op], buf, sizes[i],
+                        samples).seconds / 1e9;
+                peak[op] = (gbps[op][i] > peak[op]) ? gbps[op][i] : peak[op];
+            }
+        }
+
+        printf("kernel: %s, best GB/s: encrypt %.2f, encto %.2f, aead %.2f\n",
+                kernel, peak[0], peak[1], peak[2]);
+        printf("%12s", "bytes");
+        for (int op = 0; op < 3; op++)
+            printf(" %8s %6s %6s", names[op], "%roof", "bound");
+        printf("\n");
+        for (int i = 0; i < n; i++) {
+            printf("%12llu", (unsigned long long)sizes[i]);
+            for (int op = 0; op < 3; op++) {
+                double memory = (roofs[op] == CopyOp) ? copy[i] : xor[i];
+                double roof = (memory < peak[op]) ? memory : peak[op];
+                printf(" %8.2f %5.0f%% %6s", gbps[op][i],
+                        100 * gbps[op][i] / roof,
+                        (memory < peak[op]) ? "memory" : "cpu");
+            }
+            printf("\n");
+        }
+    }
+
+    ChaCha20SetKernel(best);
+    free(buf);
+    free(roof_dst);
+    return 0;
+}
+
+static int BenchParallel(int argc, char** argv) {
+    int max = (argc > 0) ? atoi(argv[0]) : 8;
+    uint64_t size = (argc > 1) ? strtoull(argv[1], NULL, 0) : 256ULL << 20;
+    uint8_t* buf = Buffer(size);
+    uint8_t tag[16], check[16];
+    double mac_one = 0, seal_one = 0;
+    int reps = Repetitions(size);
+
+    Poly1305(check, buf, size, key);
+    printf("kernel: %s, %llu bytes\n", ChaCha20KernelName(),
+            (unsigned long long)size);
+    printf("%8s %10s %8s %10s %8s\n", "threads", "MAC GB/s", "speedup",
+            "seal GB/s", "speedup");
+    for (int threads = 1; threads <= max; threads++) {
+        double t = Now();
+        for (int i = 0; i < reps; i++)
+            Poly1305Parallel(tag, buf, size, key, threads);
+        double mac = (Now() - t) / reps;
+        if (memcmp(tag, check, 16) != 0) {
+            printf("Poly1305Parallel() with %d threads gives the wrong tag\n",
+                    threads);
+            return 1;
+        }
+
+        t = Now();
+        for (int i = 0; i < reps; i++) {
+            ChaCha20Poly1305SealParallel(buf, size, aad, sizeof(aad), key,
+                    nonce, tag, threads);
+        }
+        double seal = (Now() - t) / reps;
+
+        if (threads == 1) {
+            mac_one = mac;
+            seal_one = seal;
+        }
+        printf("%8d %10.2f %7.2fx %10.2f %7.2fx\n", threads, size / mac / 1e9,
+                mac_one / mac, size / seal / 1e9, seal_one / seal);
+    }
+
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "fused") == 0)
+        return BenchFused(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "outofplace") == 0)
+        return BenchOutOfPlace(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "multibuffer") == 0)
+        return BenchMultiBuffer(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0)
+        return BenchBatch(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "sizes") == 0)
+        return BenchSizes(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "imix") == 0)
+        return BenchIMIX(argc - 2, argv + 2);
+#ifndef CHACHA20_NO_THREADS
+    if (argc >= 2 && strcmp(argv[1], "threads") == 0)
+        return BenchThreads(argc - 2, argv + 2);
+#endif
+    if (argc >= 2 && strcmp(argv[1], "roofline") == 0)
+        return BenchRoofline(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "parallel") == 0)
+        return BenchParallel(argc - 2, argv + 2);
+
+    printf("usage: %s fused [max bytes]\n"
+            "       %s outofplace [max bytes]\n"
+            "       %s multibuffer [messages]\n"
+            "       %s batch [messages]\n"
+            "       %s sizes [max bytes] [samples] [json file]\n"
+            "       %s imix [imix | histogram file] [packets]\n"
+            "       %s threads [max threads] [bytes] [numa]\n"
+            "       %s roofline [max bytes] [samples]\n"
+            "       %s parallel [threads] [bytes]\n", argv[0], argv[0],
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
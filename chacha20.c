@@ -1,8 +1,31 @@
 #include "chacha20.h"
+#include <stddef.h>
 #ifndef MEMCPY_IMPL_NEEDED
 #include <string.h>
 #endif
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHACHA20_X86_SIMD
+#include <immintrin.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#ifndef CHACHA20_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifndef CHACHA20_NO_IOVEC
+#include <sys/uio.h>
+#endif
+
 // Copyright(C) 2025 Shivashish Das. Licensed under the MIT License
 
 #ifdef MEMCPY_IMPL_NEEDED
@@ -26,24 +49,44 @@ void* memcpy(void* dest, const void* src, uint64_t size) {
  * This implementation of ChaCha20 can be safely used in multi-threaded 
  * programs and assumes a 64 bit environment.
  *
- * It only needs the memcpy() function (optional) from the platform and 
- * an implemenatation of memcpy is also provided if the platform does not
- * provide it.
+ * What it needs from the platform, and the switches in chacha20.h that
+ * remove each need:
+ *  - memcpy(), an implementation is provided with MEMCPY_IMPL_NEEDED.
+ *  - On x86-64 with GCC or clang, the SIMD kernels: cpuid based dispatch
+ *    through __builtin_cpu_supports(), getenv() for the CHACHA20_KERNEL
+ *    override and sysconf() for the cache size that ChaCha20EncryptTo()
+ *    switches to non-temporal stores at (fixed with CHACHA20_NT_MIN).
+ *    Other compilers and CPUs get the portable scalar code only.
+ *  - POSIX threads and sysconf() for the parallel functions and their
+ *    thread pool, CHACHA20_NO_THREADS runs them on the calling thread.
+ *  - struct iovec from <sys/uio.h> for the vectored functions,
+ *    CHACHA20_NO_IOVEC leaves those out.
  */
 
 typedef struct CryptState {
-    uint32_t cc_state[16];
-    uint8_t  key[32];
-    uint8_t  nonce[12];
-    uint32_t counter;
+    uint32_t input[16];    // constants | key | counter | nonce
+    uint32_t cc_state[16]; // serialized output of the last ChaCha20Block()
+    int      counter64;    // words 12 and 13 are one 64 bit counter
+    int      rounds;       // 20, 12 or 8
 } CryptState;
 
+// Most blocks any kernel computes per iteration
+#define MAX_KERNEL_WIDTH CHACHA20_MAX_LANES
+
 static uint32_t rol(uint32_t n, uint8_t x) {
     return (n << x) | (n >> (32- x));
 }
 
-static void AddBlockCount(CryptState* state, const uint32_t count) {
-    state->cc_state[12] = count;
+static void AddBlockCount(CryptState* state, const uint64_t count) {
+    state->input[12] = (uint32_t)count;
+    if (state->counter64)
+        state->input[13] = (uint32_t)(count >> 32);
+}
+
+static void LoadState(CryptState* state, const ChaCha20Context* ctx) {
+    memcpy(state->input, ctx->state, 16 * sizeof(uint32_t));
+    state->counter64 = ctx->counter64;
+    state->rounds = ctx->rounds;
 }
 
 static void QuarterRound(uint32_t* state, uint8_t p1, uint8_t p2, uint8_t p3, uint8_t p4) {
@@ -90,31 +133,125 @@ static void QuarterRound(uint32_t* state, uint8_t p1, uint8_t p2, uint8_t p3, ui
     state[p4] = d;
 }
 
-static void ChaCha20Block(CryptState* state) {
-    
+void ChaCha20Init(ChaCha20Context* ctx, const void* key, const void* nonce) {
     /* The ChaCha20 state is initialized as follows:
      *
      * The first four words (0-3) are constants: 0x61707865, 0x3320646e, 
      * 0x79622d32, 0x6b206574 */
-    state->cc_state[0] = 0x61707865;
-    state->cc_state[1] = 0x3320646e;
-    state->cc_state[2] = 0x79622d32;
-    state->cc_state[3] = 0x6b206574;
+    ctx->state[0] = 0x61707865;
+    ctx->state[1] = 0x3320646e;
+    ctx->state[2] = 0x79622d32;
+    ctx->state[3] = 0x6b206574;
 
     /* The next eight words (4-11) are taken from the 256-bit key by
      * reading the bytes in little-endian order, in 4-byte chunks. */
-    memcpy(&state->cc_state[4], state->key, 8 * sizeof(uint32_t));
+    memcpy(&ctx->state[4], key, 8 * sizeof(uint32_t));
 
     /* Word 12 is a block counter.  Since each block is 64-byte, a 32-bit
-       word is enough for 256 gigabytes of data */
-    state->cc_state[12] = state->counter;
+       word is enough for 256 gigabytes of data. Encryption starts at 1, as
+       block 0 is used to generate the Poly1305 key. */
+    ctx->state[12] = 1;
+    ctx->counter64 = 0;
+    ctx->rounds = 20;
+
+    if (nonce != NULL)
+        ChaCha20SetNonce(ctx, nonce);
+}
+
+/* The original ChaCha20 by D.J. Bernstein splits the last four words
+ * differently: words 12 and 13 are a 64-bit block counter (low word first)
+ * and words 14 and 15 an 8 byte nonce. Its counter starts at 0. */
+void ChaCha20InitDJB(ChaCha20Context* ctx, const void* key,
+        const void* nonce) {
+    ChaCha20Init(ctx, key, NULL);
+    ctx->counter64 = 1;
+    ctx->state[12] = 0;
+    ctx->state[13] = 0;
+
+    if (nonce != NULL)
+        ChaCha20SetNonce(ctx, nonce);
+}
 
+void ChaCha20SetNonce(ChaCha20Context* ctx, const void* nonce) {
     /* Words 13-15 are a nonce, which should not be repeated for the same
      * key.  The 13th word is the first 32 bits of the input nonce taken
      * as a little-endian integer, while the 15th word is the last 32 bits. */
-    memcpy(&state->cc_state[13], state->nonce, 3 * sizeof(uint32_t));
+    if (ctx->counter64)
+        memcpy(&ctx->state[14], nonce, 2 * sizeof(uint32_t));
+    else
+        memcpy(&ctx->state[13], nonce, 3 * sizeof(uint32_t));
+}
+
+void ChaCha20SetCounter(ChaCha20Context* ctx, const uint32_t counter) {
+    ChaCha20SetCounter64(ctx, counter);
+}
+
+int ChaCha20SetCounter64(ChaCha20Context* ctx, const uint64_t counter) {
+    if (!ctx->counter64 && counter > 0xffffffff)
+        return -1;
+
+    ctx->state[12] = (uint32_t)counter;
+    if (ctx->counter64)
+        ctx->state[13] = (uint32_t)(counter >> 32);
+    return 0;
+}
+
+int ChaCha20SetRounds(ChaCha20Context* ctx, const int rounds) {
+    if (rounds != 20 && rounds != 12 && rounds != 8)
+        return -1;
 
+    ctx->rounds = rounds;
+    return 0;
+}
+
+static uint64_t Counter(const ChaCha20Context* ctx) {
+    uint64_t counter = ctx->state[12];
+    if (ctx->counter64)
+        counter |= (uint64_t)ctx->state[13] << 32;
+    return counter;
+}
+
+/* Returns 0 if every block of bytes offset .. offset + size - 1 gets a
+ * counter of its own, and -1 if the counter would have to wrap around and
+ * reuse the keystream of the first blocks. */
+static int CheckRange(const ChaCha20Context* ctx, const uint64_t size,
+        const uint64_t offset) {
+    if (size == 0)
+        return 0;
+    if (size - 1 > ~offset)
+        return -1;
+
+    uint64_t last = (offset + size - 1) / 64;
+    uint64_t left = ctx->counter64 ? ~Counter(ctx) : 0xffffffff - Counter(ctx);
+    return (last <= left) ? 0 : -1;
+}
+
+/* The double rounds of the block function (inner_block below) applied to x
+ * in place, without adding the input back. HChaCha20() uses them as is.
+ *
+ * The round count is a parameter of this and of every kernel so that the
+ * reduced round variants ChaCha8 and ChaCha12 share their code. Kernels are
+ * instantiated once per round count with a constant (see KERNEL_ROUNDS), so
+ * the compiler unrolls the rounds and there is no test of the count left in
+ * the loops. */
+static ALWAYS_INLINE void ChaCha20Rounds(uint32_t x[16], const int rounds) {
+    for (int i = 0; i < rounds; i += 2) {
+        QuarterRound(x, 0, 4, 8, 12);
+        QuarterRound(x, 1, 5, 9, 13);
+        QuarterRound(x, 2, 6, 10, 14);
+        QuarterRound(x, 3, 7, 11, 15);
+        QuarterRound(x, 0, 5, 10, 15);
+        QuarterRound(x, 1, 6, 11, 12);
+        QuarterRound(x, 2, 7, 8, 13);
+        QuarterRound(x, 3, 4, 9, 14);
+    }
+}
 
+/* Produces the block for the counter in state->input[12] into
+ * state->cc_state and moves the counter to the next block. The rest of the
+ * input state was set up once by ChaCha20Init() and is not touched here. */
+static ALWAYS_INLINE void ChaCha20Block(CryptState* state,
+        const int rounds) {
     /* The below code implements the chacha20_block pseudocode
      * obtained from the RFC */
 
@@ -141,36 +278,23 @@ static void ChaCha20Block(CryptState* state) {
     */
     
     uint32_t working_state[16];
-    memcpy(working_state, state->cc_state, 16 * sizeof(uint32_t));
-
-    for (int i = 0; i < 10; i++) {
-        QuarterRound(working_state, 0, 4, 8, 12);
-        QuarterRound(working_state, 1, 5, 9, 13);
-        QuarterRound(working_state, 2, 6, 10, 14);
-        QuarterRound(working_state, 3, 7, 11, 15);
-        QuarterRound(working_state, 0, 5, 10, 15);
-        QuarterRound(working_state, 1, 6, 11, 12);
-        QuarterRound(working_state, 2, 7, 8, 13);
-        QuarterRound(working_state, 3, 4, 9, 14);
-    }
+    memcpy(working_state, state->input, 16 * sizeof(uint32_t));
+    ChaCha20Rounds(working_state, rounds);
 
     for (int i = 0; i < 16; i++) {
-        state->cc_state[i] += working_state[i];
+        state->cc_state[i] = state->input[i] + working_state[i];
     }
 
-    state->counter++;
+    state->input[12]++;
 }
 
-void Encrypt(void* d, const uint64_t size, const void* k, const void* n) {
-    uint8_t* data = d;
-    const uint8_t* key = k;
-    const uint8_t* nonce = n;
-
-    int64_t i = 0;
-    CryptState state;
-    memcpy(state.key, k, 8 * sizeof(uint32_t));
-    memcpy(state.nonce, n, 3 * sizeof(uint32_t));
-    state.counter = 1;
+/* XORs the keystream starting at state->input[12] into src and writes the
+ * result to dst, one block at a time. dst may be the same as src. This is
+ * the portable kernel and handles any size. */
+static ALWAYS_INLINE uint64_t ChaCha20XorScalar(CryptState* state,
+        uint8_t* dst, const uint8_t* src, const uint64_t size,
+        const int rounds) {
+    uint64_t i = 0;
 
     /* The below code is an implementation of the chacha20_encrypt pseudocode
      * taken from the RFC. */
@@ -191,86 +315,2781 @@ void Encrypt(void* d, const uint64_t size, const void* k, const void* n) {
      * end
     */
     for (i = 0; i < (size/64); i++) {
-        ChaCha20Block(&state);
-        uint8_t* block = (uint8_t*)state.cc_state;
+        ChaCha20Block(state, rounds);
+        uint8_t* block = (uint8_t*)state->cc_state;
         for (int j = 0; j < 64; j++) {
-            data[i * 64 + j] ^= block[j];
+            dst[i * 64 + j] = src[i * 64 + j] ^ block[j];
         }
     }
 
     if (size % 64 != 0) {
-        ChaCha20Block(&state);
-        uint8_t* block = (uint8_t*)state.cc_state;
-        for (int j = 0; j < (size % 64); j++) {
-            data[i * 64 + j] ^= block[j];
+        ChaCha20Block(state, rounds);
+        uint8_t* block = (uint8_t*)state->cc_state;
+        for (uint64_t j = 0; j < (size % 64); j++) {
+            dst[i * 64 + j] = src[i * 64 + j] ^ block[j];
         }
     }
+
+    return size;
 }
 
+/* The rounds kernels apply the 20 rounds to as many independent states as
+ * the kernel is wide. The states are given word-sliced, x[i][j] is word i of
+ * state j, so every state can have its own key, nonce and counter. If ks is
+ * NULL the result replaces x without adding the input back, which is what
+ * HChaCha20Batch() needs. Otherwise the input is added back as in
+ * ChaCha20Block() and the serialized block of state j is written to
+ * ks + 64 * j, which is how the multi-buffer manager gets the next block of
+ * every lane at once. */
+static void ChaCha20RoundsScalar(uint32_t x[16][MAX_KERNEL_WIDTH],
+        uint8_t* ks) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++)
+        w[i] = x[i][0];
 
-static void Poly1305GenKey(CryptState* state, const uint8_t* k, const uint8_t* n) {
-    /*
-     * poly1305_key_gen(key,nonce):
-     *   counter = 0
-     *   block = chacha20_block(key,counter,nonce)
-     *   return block[0..31]
-     *   end */
-    state->counter = 0;
-    memcpy(state->key, k, 8 * sizeof(uint32_t));
-    memcpy(state->nonce, n, 3 * sizeof(uint32_t));
-    ChaCha20Block(state);
-
-    // The returned key is present in state->cc_state[0..7]
-}
-
-void Poly1305MAC(uint8_t* tag, const void* msg, const uint64_t size, const void* key, const void* nonce) {
-    CryptState ks;
-    Poly1305GenKey(&ks, key, nonce);
-    uint8_t* r = (uint8_t*) ks.cc_state;
-
-    // clamp r - code obtained RFC 8439 which in turn is adapated from
-    // poly1305aes_test_clamp.c version 20050207 D. J. Bernstein Public domain.
-    r[3] &= 15;
-    r[7] &= 15;
-    r[11] &= 15;
-    r[15] &= 15;
-    r[4] &= 252;
-    r[8] &= 252;
-    r[12] &= 252;
-
-    uint8_t* s = (uint8_t*) (ks.cc_state + 4);
-    const uint8_t P[] = { 0x03, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfb };
-    const uint8_t* start = msg;
-    
-    // the tag is the final answer so we don't create an accumulator separately
-    uint64_t nblocks = (size % 16 == 0) ? size/16 : (size/16) + 1; 
-    for (uint64_t i = 1; i <= nblocks; i++) {
-        uint8_t n[17] = {0};
-        uint64_t used = 0;
-        if (size > 16) {
-            memcpy(n, start + ((i - 1) * 16), 16);
-            size -= 16;
-            used = 16;
-            n[16] = 0x1;
+    ChaCha20Rounds(w, 20);
+
+    for (int i = 0; i < 16; i++) {
+        if (ks == NULL)
+            x[i][0] = w[i];
+        else
+            w[i] += x[i][0];
+    }
+    if (ks != NULL)
+        memcpy(ks, w, 64);
+}
+
+#ifdef CHACHA20_X86_SIMD
+/* SSE2 implementation computing 4 blocks at once with the same word-sliced
+ * layout as the AVX2 kernel below. SSE2 is part of x86-64 so this kernel is
+ * always available. With SSSE3 the rotations by 16 and 8 bits are done with a
+ * single pshufb, plain SSE2 has to use shifts (or 16 bit shuffles). */
+#define ROL_SSE(x, n) \
+    _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define ROL16_SSE2(x) _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1)
+#define ROL8_SSE2(x) ROL_SSE(x, 8)
+#define ROL16_SSSE3(x) _mm_shuffle_epi8(x, rot16)
+#define ROL8_SSSE3(x) _mm_shuffle_epi8(x, rot8)
+
+#define QR_SSE(a, b, c, d, ROL16, ROL8)       \
+    do {                                      \
+        a = _mm_add_epi32(a, b);              \
+        d = ROL16(_mm_xor_si128(d, a));       \
+        c = _mm_add_epi32(c, d);              \
+        b = ROL_SSE(_mm_xor_si128(b, c), 12); \
+        a = _mm_add_epi32(a, b);              \
+        d = ROL8(_mm_xor_si128(d, a));        \
+        c = _mm_add_epi32(c, d);              \
+        b = ROL_SSE(_mm_xor_si128(b, c), 7);  \
+    } while (0)
+
+#define DOUBLE_ROUND_SSE(x, ROL16, ROL8)                  \
+    do {                                                  \
+        QR_SSE(x[0], x[4], x[8], x[12], ROL16, ROL8);     \
+        QR_SSE(x[1], x[5], x[9], x[13], ROL16, ROL8);     \
+        QR_SSE(x[2], x[6], x[10], x[14], ROL16, ROL8);    \
+        QR_SSE(x[3], x[7], x[11], x[15], ROL16, ROL8);    \
+        QR_SSE(x[0], x[5], x[10], x[15], ROL16, ROL8);    \
+        QR_SSE(x[1], x[6], x[11], x[12], ROL16, ROL8);    \
+        QR_SSE(x[2], x[7], x[8], x[13], ROL16, ROL8);     \
+        QR_SSE(x[3], x[4], x[9], x[14], ROL16, ROL8);     \
+    } while (0)
+
+// Source of the zeros that the transposes XOR into when storing plain blocks
+static const uint8_t zero_blocks[64 * MAX_KERNEL_WIDTH];
+
+static inline void SetupSSE(const CryptState* state, __m128i s[16]) {
+    for (int i = 0; i < 16; i++)
+        s[i] = _mm_set1_epi32(state->input[i]);
+    s[12] = _mm_add_epi32(s[12], _mm_setr_epi32(0, 1, 2, 3));
+}
+
+/* Transposes words w..w+3 of 4 blocks back into rows and stores row j XOR
+ * src + 64 * j to dst + 64 * j. */
+static inline void XorTransposeSSE(uint8_t* dst, const uint8_t* src,
+        __m128i a0, __m128i a1, __m128i a2, __m128i a3) {
+    __m128i t0 = _mm_unpacklo_epi32(a0, a1);
+    __m128i t1 = _mm_unpackhi_epi32(a0, a1);
+    __m128i t2 = _mm_unpacklo_epi32(a2, a3);
+    __m128i t3 = _mm_unpackhi_epi32(a2, a3);
+
+    __m128i r[4];
+    r[0] = _mm_unpacklo_epi64(t0, t2);
+    r[1] = _mm_unpackhi_epi64(t0, t2);
+    r[2] = _mm_unpacklo_epi64(t1, t3);
+    r[3] = _mm_unpackhi_epi64(t1, t3);
+
+    for (int k = 0; k < 4; k++) {
+        __m128i* p = (__m128i*)(dst + 64 * k);
+        const __m128i* q = (const __m128i*)(src + 64 * k);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(q), r[k]));
+    }
+}
+
+// Adds the input state back, serializes the 4 blocks into dst and moves on
+static inline void FinishSSE(CryptState* state, uint8_t* dst,
+        const uint8_t* src, __m128i x[16], __m128i s[16]) {
+    for (int i = 0; i < 16; i++)
+        x[i] = _mm_add_epi32(x[i], s[i]);
+
+    XorTransposeSSE(dst, src, x[0], x[1], x[2], x[3]);
+    XorTransposeSSE(dst + 16, src + 16, x[4], x[5], x[6], x[7]);
+    XorTransposeSSE(dst + 32, src + 32, x[8], x[9], x[10], x[11]);
+    XorTransposeSSE(dst + 48, src + 48, x[12], x[13], x[14], x[15]);
+
+    s[12] = _mm_add_epi32(s[12], _mm_set1_epi32(4));
+    state->input[12] += 4;
+}
+
+/* Both kernels XOR the keystream into src 256 bytes (4 blocks) at a time,
+ * starting at state->input[12], write the result to dst and return how many
+ * bytes were processed. */
+static ALWAYS_INLINE uint64_t ChaCha20XorSSE2(CryptState* state,
+        uint8_t* dst, const uint8_t* src, const uint64_t size,
+        const int rounds) {
+    __m128i s[16];
+    SetupSSE(state, s);
+
+    uint64_t done = 0;
+    for (; size - done >= 256; done += 256) {
+        __m128i x[16];
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+#pragma GCC unroll 10
+        for (int i = 0; i < rounds; i += 2)
+            DOUBLE_ROUND_SSE(x, ROL16_SSE2, ROL8_SSE2);
+
+        FinishSSE(state, dst + done, src + done, x, s);
+    }
+
+    return done;
+}
+
+// Stores the rounds kernel result v for the input x as described above
+static inline void StoreRoundsSSE(uint32_t x[16][MAX_KERNEL_WIDTH],
+        uint8_t* ks, __m128i v[16]) {
+    if (ks == NULL) {
+        for (int i = 0; i < 16; i++)
+            _mm_storeu_si128((__m128i*)x[i], v[i]);
+        return;
+    }
+
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm_add_epi32(v[i], _mm_loadu_si128((const __m128i*)x[i]));
+
+    XorTransposeSSE(ks, zero_blocks, v[0], v[1], v[2], v[3]);
+    XorTransposeSSE(ks + 16, zero_blocks, v[4], v[5], v[6], v[7]);
+    XorTransposeSSE(ks + 32, zero_blocks, v[8], v[9], v[10], v[11]);
+    XorTransposeSSE(ks + 48, zero_blocks, v[12], v[13], v[14], v[15]);
+}
+
+static void ChaCha20RoundsSSE2(uint32_t x[16][MAX_KERNEL_WIDTH],
+        uint8_t* ks) {
+    __m128i v[16];
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm_loadu_si128((const __m128i*)x[i]);
+
+#pragma GCC unroll 10
+    for (int i = 0; i < 10; i++)
+        DOUBLE_ROUND_SSE(v, ROL16_SSE2, ROL8_SSE2);
+
+    StoreRoundsSSE(x, ks, v);
+}
+
+__attribute__((target("ssse3")))
+static ALWAYS_INLINE uint64_t ChaCha20XorSSSE3(CryptState* state,
+        uint8_t* dst, const uint8_t* src, const uint64_t size,
+        const int rounds) {
+    const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8,
+            9, 14, 15, 12, 13);
+    const __m128i rot8 = _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10,
+            15, 12, 13, 14);
+
+    __m128i s[16];
+    SetupSSE(state, s);
+
+    uint64_t done = 0;
+    for (; size - done >= 256; done += 256) {
+        __m128i x[16];
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+#pragma GCC unroll 10
+        for (int i = 0; i < rounds; i += 2)
+            DOUBLE_ROUND_SSE(x, ROL16_SSSE3, ROL8_SSSE3);
+
+        FinishSSE(state, dst + done, src + done, x, s);
+    }
+
+    return done;
+}
+
+__attribute__((target("ssse3")))
+static void ChaCha20RoundsSSSE3(uint32_t x[16][MAX_KERNEL_WIDTH],
+        uint8_t* ks) {
+    const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8,
+            9, 14, 15, 12, 13);
+    const __m128i rot8 = _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10,
+            15, 12, 13, 14);
+
+    __m128i v[16];
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm_loadu_si128((const __m128i*)x[i]);
+
+#pragma GCC unroll 10
+    for (int i = 0; i < 10; i++)
+        DOUBLE_ROUND_SSE(v, ROL16_SSSE3, ROL8_SSSE3);
+
+    StoreRoundsSSE(x, ks, v);
+}
+
+/* AVX2 implementation that computes 8 consecutive blocks at once. The state
+ * is kept "word-sliced": vector x[i] holds word i of all 8 blocks, lane j
+ * belonging to the block with counter + j. This way every step of
+ * QuarterRound() becomes a single instruction working on 8 blocks and the
+ * rounds need no shuffling between columns and diagonals. Only at the end
+ * the words are transposed back into 8 serialized 64-byte blocks. */
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+#define ROL_AVX2(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+// Rotations by 16 and 8 bits only move whole bytes, so use a byte shuffle
+#define QR_AVX2(a, b, c, d)                                     \
+    do {                                                        \
+        a = _mm256_add_epi32(a, b);                             \
+        d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+        c = _mm256_add_epi32(c, d);                             \
+        b = _mm256_xor_si256(b, c);                             \
+        b = ROL_AVX2(b, 12);                                    \
+        a = _mm256_add_epi32(a, b);                             \
+        d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);  \
+        c = _mm256_add_epi32(c, d);                             \
+        b = _mm256_xor_si256(b, c);                             \
+        b = ROL_AVX2(b, 7);                                     \
+    } while (0)
+
+#define DOUBLE_ROUND_AVX2(x)                    \
+    do {                                        \
+        QR_AVX2(x[0], x[4], x[8], x[12]);       \
+        QR_AVX2(x[1], x[5], x[9], x[13]);       \
+        QR_AVX2(x[2], x[6], x[10], x[14]);      \
+        QR_AVX2(x[3], x[7], x[11], x[15]);      \
+        QR_AVX2(x[0], x[5], x[10], x[15]);      \
+        QR_AVX2(x[1], x[6], x[11], x[12]);      \
+        QR_AVX2(x[2], x[7], x[8], x[13]);       \
+        QR_AVX2(x[3], x[4], x[9], x[14]);       \
+    } while (0)
+
+/* Transposes 8 word-sliced vectors (words w..w+7 of 8 blocks) into 8 rows of
+ * 32 bytes and stores row j XOR src + 64 * j to dst + 64 * j. */
+AVX2_TARGET static inline void XorTransposeAVX2(uint8_t* dst,
+        const uint8_t* src, __m256i a0, __m256i a1, __m256i a2, __m256i a3,
+        __m256i a4, __m256i a5, __m256i a6, __m256i a7) {
+    __m256i t0 = _mm256_unpacklo_epi32(a0, a1);
+    __m256i t1 = _mm256_unpackhi_epi32(a0, a1);
+    __m256i t2 = _mm256_unpacklo_epi32(a2, a3);
+    __m256i t3 = _mm256_unpackhi_epi32(a2, a3);
+    __m256i t4 = _mm256_unpacklo_epi32(a4, a5);
+    __m256i t5 = _mm256_unpackhi_epi32(a4, a5);
+    __m256i t6 = _mm256_unpacklo_epi32(a6, a7);
+    __m256i t7 = _mm256_unpackhi_epi32(a6, a7);
+
+    // u[k] and v[k] hold words w..w+3 and w+4..w+7 of blocks k and k + 4
+    __m256i u[4], v[4];
+    u[0] = _mm256_unpacklo_epi64(t0, t2);
+    u[1] = _mm256_unpackhi_epi64(t0, t2);
+    u[2] = _mm256_unpacklo_epi64(t1, t3);
+    u[3] = _mm256_unpackhi_epi64(t1, t3);
+    v[0] = _mm256_unpacklo_epi64(t4, t6);
+    v[1] = _mm256_unpackhi_epi64(t4, t6);
+    v[2] = _mm256_unpacklo_epi64(t5, t7);
+    v[3] = _mm256_unpackhi_epi64(t5, t7);
+
+    for (int k = 0; k < 4; k++) {
+        __m256i lo = _mm256_permute2x128_si256(u[k], v[k], 0x20);
+        __m256i hi = _mm256_permute2x128_si256(u[k], v[k], 0x31);
+        const __m256i* p = (const __m256i*)(src + 64 * k);
+        const __m256i* q = (const __m256i*)(src + 64 * (k + 4));
+        _mm256_storeu_si256((__m256i*)(dst + 64 * k),
+                _mm256_xor_si256(_mm256_loadu_si256(p), lo));
+        _mm256_storeu_si256((__m256i*)(dst + 64 * (k + 4)),
+                _mm256_xor_si256(_mm256_loadu_si256(q), hi));
+    }
+}
+
+/* XORs the keystream into src 512 bytes (8 blocks) at a time, starting at
+ * state->input[12], writes the result to dst and returns how many bytes were
+ * processed. The remaining (size % 512) bytes are left for the caller. */
+AVX2_TARGET static ALWAYS_INLINE uint64_t ChaCha20XorAVX2(CryptState* state,
+        uint8_t* dst, const uint8_t* src, const uint64_t size,
+        const int rounds) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11,
+            8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14,
+            15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9,
+            10, 15, 12, 13, 14, 3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12,
+            13, 14);
+
+    __m256i s[16];
+    for (int i = 0; i < 16; i++)
+        s[i] = _mm256_set1_epi32(state->input[i]);
+    s[12] = _mm256_add_epi32(s[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+    uint64_t done = 0;
+    for (; size - done >= 512; done += 512) {
+        __m256i x[16];
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+#pragma GCC unroll 10
+        for (int i = 0; i < rounds; i += 2)
+            DOUBLE_ROUND_AVX2(x);
+
+        for (int i = 0; i < 16; i++)
+            x[i] = _mm256_add_epi32(x[i], s[i]);
+
+        XorTransposeAVX2(dst + done, src + done, x[0], x[1], x[2], x[3],
+                x[4], x[5], x[6], x[7]);
+        XorTransposeAVX2(dst + done + 32, src + done + 32, x[8], x[9], x[10],
+                x[11], x[12], x[13], x[14], x[15]);
+
+        s[12] = _mm256_add_epi32(s[12], _mm256_set1_epi32(8));
+        state->input[12] += 8;
+    }
+
+    return done;
+}
+
+AVX2_TARGET static void ChaCha20RoundsAVX2(uint32_t x[16][MAX_KERNEL_WIDTH],
+        uint8_t* ks) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11,
+            8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14,
+            15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9,
+            10, 15, 12, 13, 14, 3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12,
+            13, 14);
+
+    __m256i v[16];
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm256_loadu_si256((const __m256i*)x[i]);
+
+#pragma GCC unroll 10
+    for (int i = 0; i < 10; i++)
+        DOUBLE_ROUND_AVX2(v);
+
+    if (ks == NULL) {
+        for (int i = 0; i < 16; i++)
+            _mm256_storeu_si256((__m256i*)x[i], v[i]);
+        return;
+    }
+
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm256_add_epi32(v[i], _mm256_loadu_si256((__m256i*)x[i]));
+
+    XorTransposeAVX2(ks, zero_blocks, v[0], v[1], v[2], v[3], v[4], v[5],
+            v[6], v[7]);
+    XorTransposeAVX2(ks + 32, zero_blocks, v[8], v[9], v[10], v[11], v[12],
+            v[13], v[14], v[15]);
+}
+
+/* AVX-512 implementation computing 16 blocks (1 KiB) per iteration. It uses
+ * the same word-sliced layout as the AVX2 kernel, but AVX-512F has a native
+ * rotate (vprold) so no shuffles are needed in the rounds. Byte-granular
+ * masked loads and stores (AVX-512BW) let it handle the final partial batch
+ * as well, so this kernel always processes the whole buffer. */
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+
+#define QR_AVX512(a, b, c, d)                                   \
+    do {                                                        \
+        a = _mm512_add_epi32(a, b);                             \
+        d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16);       \
+        c = _mm512_add_epi32(c, d);                             \
+        b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12);       \
+        a = _mm512_add_epi32(a, b);                             \
+        d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8);        \
+        c = _mm512_add_epi32(c, d);                             \
+        b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7);        \
+    } while (0)
+
+#define DOUBLE_ROUND_AVX512(x)                  \
+    do {                                        \
+        QR_AVX512(x[0], x[4], x[8], x[12]);     \
+        QR_AVX512(x[1], x[5], x[9], x[13]);     \
+        QR_AVX512(x[2], x[6], x[10], x[14]);    \
+        QR_AVX512(x[3], x[7], x[11], x[15]);    \
+        QR_AVX512(x[0], x[5], x[10], x[15]);    \
+        QR_AVX512(x[1], x[6], x[11], x[12]);    \
+        QR_AVX512(x[2], x[7], x[8], x[13]);     \
+        QR_AVX512(x[3], x[4], x[9], x[14]);     \
+    } while (0)
+
+/* Transposes the 16 word-sliced vectors in place, afterwards x[j] holds the
+ * serialized block j. */
+AVX512_TARGET static inline void TransposeAVX512(__m512i x[16]) {
+    __m512i t[16], u[4][4];
+    for (int i = 0; i < 16; i += 2) {
+        t[i] = _mm512_unpacklo_epi32(x[i], x[i + 1]);
+        t[i + 1] = _mm512_unpackhi_epi32(x[i], x[i + 1]);
+    }
+
+    // u[g][k] holds words 4g..4g+3 of blocks k, k + 4, k + 8 and k + 12
+    for (int g = 0; g < 4; g++) {
+        u[g][0] = _mm512_unpacklo_epi64(t[4 * g], t[4 * g + 2]);
+        u[g][1] = _mm512_unpackhi_epi64(t[4 * g], t[4 * g + 2]);
+        u[g][2] = _mm512_unpacklo_epi64(t[4 * g + 1], t[4 * g + 3]);
+        u[g][3] = _mm512_unpackhi_epi64(t[4 * g + 1], t[4 * g + 3]);
+    }
+
+    for (int k = 0; k < 4; k++) {
+        __m512i p = _mm512_shuffle_i32x4(u[0][k], u[1][k], 0x88);
+        __m512i q = _mm512_shuffle_i32x4(u[0][k], u[1][k], 0xdd);
+        __m512i r = _mm512_shuffle_i32x4(u[2][k], u[3][k], 0x88);
+        __m512i s = _mm512_shuffle_i32x4(u[2][k], u[3][k], 0xdd);
+        x[k] = _mm512_shuffle_i32x4(p, r, 0x88);
+        x[k + 4] = _mm512_shuffle_i32x4(q, s, 0x88);
+        x[k + 8] = _mm512_shuffle_i32x4(p, r, 0xdd);
+        x[k + 12] = _mm512_shuffle_i32x4(q, s, 0xdd);
+    }
+}
+
+/* XORs the keystream into all of src starting at state->input[12] and writes
+ * the result to dst. Buffers under 256 bytes are left to the scalar kernel,
+ * as computing 16 blocks for them costs more than it saves. */
+AVX512_TARGET static ALWAYS_INLINE uint64_t ChaCha20XorAVX512(
+        CryptState* state, uint8_t* dst, const uint8_t* src,
+        const uint64_t size, const int rounds) {
+    if (size < 256)
+        return 0;
+
+    __m512i s[16];
+    for (int i = 0; i < 16; i++)
+        s[i] = _mm512_set1_epi32(state->input[i]);
+    s[12] = _mm512_add_epi32(s[12], _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6,
+                7, 8, 9, 10, 11, 12, 13, 14, 15));
+
+    uint64_t done = 0;
+    while (done < size) {
+        __m512i x[16];
+        for (int i = 0; i < 16; i++)
+            x[i] = s[i];
+
+#pragma GCC unroll 10
+        for (int i = 0; i < rounds; i += 2)
+            DOUBLE_ROUND_AVX512(x);
+
+        for (int i = 0; i < 16; i++)
+            x[i] = _mm512_add_epi32(x[i], s[i]);
+
+        TransposeAVX512(x);
+
+        uint64_t n = size - done;
+        if (n >= 1024) {
+            n = 1024;
+            for (int j = 0; j < 16; j++) {
+                uint64_t p = done + 64 * j;
+                _mm512_storeu_si512(dst + p, _mm512_xor_si512(
+                            _mm512_loadu_si512(src + p), x[j]));
+            }
         }
 
         else {
-            memcpy(n, start + ((i - 1) * 16), size);
-            used = size;
-            n[size] = 0x1;
+            // Final partial batch, bytes past the end are masked off
+            for (uint64_t j = 0; 64 * j < n; j++) {
+                uint64_t p = done + 64 * j;
+                uint64_t left = n - 64 * j;
+                __mmask64 m = (left >= 64) ? ~0ULL : (1ULL << left) - 1;
+                _mm512_mask_storeu_epi8(dst + p, m, _mm512_xor_si512(
+                            _mm512_maskz_loadu_epi8(m, src + p), x[j]));
+            }
+        }
+
+        s[12] = _mm512_add_epi32(s[12], _mm512_set1_epi32(16));
+        state->input[12] += (n + 63) / 64;
+        done += n;
+    }
+
+    return done;
+}
+
+AVX512_TARGET static void ChaCha20RoundsAVX512(
+        uint32_t x[16][MAX_KERNEL_WIDTH], uint8_t* ks) {
+    __m512i v[16];
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm512_loadu_si512(x[i]);
+
+#pragma GCC unroll 10
+    for (int i = 0; i < 10; i++)
+        DOUBLE_ROUND_AVX512(v);
+
+    if (ks == NULL) {
+        for (int i = 0; i < 16; i++)
+            _mm512_storeu_si512(x[i], v[i]);
+        return;
+    }
+
+    for (int i = 0; i < 16; i++)
+        v[i] = _mm512_add_epi32(v[i], _mm512_loadu_si512(x[i]));
+
+    TransposeAVX512(v);
+    for (int j = 0; j < 16; j++)
+        _mm512_storeu_si512(ks + 64 * j, v[j]);
+}
+#endif
+
+/* Kernel dispatch. The best kernel for the host CPU is chosen once when the
+ * library is loaded, Encrypt() then only follows active_kernel without any
+ * further feature checks. The environment variable CHACHA20_KERNEL can force
+ * a particular kernel (scalar, sse2, ssse3, avx2 or avx512), which is useful
+ * to compare kernels or to rule out the SIMD code while debugging. */
+typedef uint64_t (*KernelFn)(CryptState* state, uint8_t* dst,
+        const uint8_t* src, const uint64_t size);
+typedef void (*RoundsFn)(uint32_t x[16][MAX_KERNEL_WIDTH], uint8_t* ks);
+
+/* Instantiates the kernel fn for 20, 12 and 8 rounds as fn_20, fn_12 and
+ * fn_8. KERNEL_VARIANTS(fn) lists them in the order of Kernel.fn. */
+#define KERNEL_ROUNDS(attr, fn)                                        \
+    attr static uint64_t fn##_20(CryptState* state, uint8_t* dst,      \
+            const uint8_t* src, const uint64_t size) {                 \
+        return fn(state, dst, src, size, 20);                          \
+    }                                                                  \
+    attr static uint64_t fn##_12(CryptState* state, uint8_t* dst,      \
+            const uint8_t* src, const uint64_t size) {                 \
+        return fn(state, dst, src, size, 12);                          \
+    }                                                                  \
+    attr static uint64_t fn##_8(CryptState* state, uint8_t* dst,       \
+            const uint8_t* src, const uint64_t size) {                 \
+        return fn(state, dst, src, size, 8);                           \
+    }
+
+#define KERNEL_VARIANTS(fn) { fn##_20, fn##_12, fn##_8 }
+
+KERNEL_ROUNDS(, ChaCha20XorScalar)
+#ifdef CHACHA20_X86_SIMD
+KERNEL_ROUNDS(, ChaCha20XorSSE2)
+KERNEL_ROUNDS(__attribute__((target("ssse3"))), ChaCha20XorSSSE3)
+KERNEL_ROUNDS(AVX2_TARGET, ChaCha20XorAVX2)
+KERNEL_ROUNDS(AVX512_TARGET, ChaCha20XorAVX512)
+#endif
+
+typedef struct Kernel {
+    const char* name;
+    KernelFn    fn[3]; // with 20, 12 and 8 rounds, see RoundsVariant()
+    RoundsFn    rounds;
+    int         width; // blocks computed per iteration
+    int         next;  // kernel that handles whatever fn leaves over
+} Kernel;
+
+static int RoundsVariant(const int rounds) {
+    return (rounds == 20) ? 0 : (rounds == 12) ? 1 : 2;
+}
+
+enum {
+    KERNEL_SCALAR,
+#ifdef CHACHA20_X86_SIMD
+    KERNEL_SSE2,
+    KERNEL_SSSE3,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+#endif
+    KERNEL_COUNT
+};
+
+static const Kernel kernels[KERNEL_COUNT] = {
+    [KERNEL_SCALAR] = { "scalar", KERNEL_VARIANTS(ChaCha20XorScalar),
+        ChaCha20RoundsScalar, 1, KERNEL_SCALAR },
+#ifdef CHACHA20_X86_SIMD
+    [KERNEL_SSE2]   = { "sse2", KERNEL_VARIANTS(ChaCha20XorSSE2),
+        ChaCha20RoundsSSE2, 4, KERNEL_SCALAR },
+    [KERNEL_SSSE3]  = { "ssse3", KERNEL_VARIANTS(ChaCha20XorSSSE3),
+        ChaCha20RoundsSSSE3, 4, KERNEL_SCALAR },
+    [KERNEL_AVX2]   = { "avx2", KERNEL_VARIANTS(ChaCha20XorAVX2),
+        ChaCha20RoundsAVX2, 8, KERNEL_SSSE3 },
+    [KERNEL_AVX512] = { "avx512", KERNEL_VARIANTS(ChaCha20XorAVX512),
+        ChaCha20RoundsAVX512, 16, KERNEL_SCALAR },
+#endif
+};
+
+static int active_kernel = KERNEL_SCALAR;
+
+static int KernelSupported(const int kern) {
+#ifdef CHACHA20_X86_SIMD
+    switch (kern) {
+    case KERNEL_SSE2:
+        return 1;
+    case KERNEL_SSSE3:
+        return __builtin_cpu_supports("ssse3");
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw");
+    }
+#endif
+    return kern == KERNEL_SCALAR;
+}
+
+static int NameEquals(const char* a, const char* b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+
+    return *a == *b;
+}
+
+int ChaCha20SetKernel(const char* name) {
+    for (int kern = 0; kern < KERNEL_COUNT; kern++) {
+        if (NameEquals(kernels[kern].name, name)) {
+            if (!KernelSupported(kern))
+                return -1;
+
+            active_kernel = kern;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char* ChaCha20KernelName(void) {
+    return kernels[active_kernel].name;
+}
+
+#ifdef CHACHA20_X86_SIMD
+// Poly1305 follows the kernel choice, so forcing a kernel also pins the MAC
+static int KernelHasAVX2(void) {
+    return active_kernel == KERNEL_AVX2 || active_kernel == KERNEL_AVX512;
+}
+
+// The multi-buffer Poly1305 needs AVX-512 IFMA next to the avx512 kernel
+static int KernelHasIFMA(void) {
+    return active_kernel == KERNEL_AVX512 &&
+        __builtin_cpu_supports("avx512ifma");
+}
+#endif
+
+#ifdef CHACHA20_X86_SIMD
+/* ChaCha20EncryptTo() switches to non-temporal stores from this size on. By
+ * default it is the size of the last level cache: an output that large would
+ * push everything else out of the cache and is unlikely to be read again
+ * before it is evicted itself. */
+static uint64_t nt_min = CHACHA20_NT_MIN;
+
+static uint64_t CacheSize(void) {
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0)
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (llc > 0)
+        return (uint64_t)llc;
+#endif
+    return 32 << 20;
+}
+
+__attribute__((constructor)) static void ChaCha20SelectKernel(void) {
+    if (nt_min == 0)
+        nt_min = CacheSize();
+
+    __builtin_cpu_init();
+    for (int kern = KERNEL_COUNT - 1; kern >= 0; kern--) {
+        if (KernelSupported(kern)) {
+            active_kernel = kern;
+            break;
+        }
+    }
+
+    const char* forced = getenv("CHACHA20_KERNEL");
+    if (forced != NULL)
+        ChaCha20SetKernel(forced);
+}
+#endif
+
+/* Encrypts src into dst (which may be src) as if src was found at the given
+ * byte offset of the message. */
+static int EncryptRange(const ChaCha20Context* ctx, uint8_t* dst,
+        const uint8_t* src, const uint64_t size, const uint64_t offset) {
+    uint64_t rem = size;
+    if (CheckRange(ctx, size, offset) != 0)
+        return -1;
+
+    CryptState state;
+    LoadState(&state, ctx);
+    uint64_t counter = Counter(ctx) + offset / 64;
+    const int variant = RoundsVariant(ctx->rounds);
+
+    /* If the offset is not on a block boundary only the end of the first
+     * block is used, the kernels below then start on the next one. */
+    uint64_t skip = offset % 64;
+    if (skip != 0 && rem > 0) {
+        AddBlockCount(&state, counter++);
+        ChaCha20Block(&state, state.rounds);
+        uint8_t* block = (uint8_t*)state.cc_state;
+        uint64_t n = (64 - skip < rem) ? 64 - skip : rem;
+        for (uint64_t j = 0; j < n; j++) {
+            dst[j] = src[j] ^ block[skip + j];
+        }
+
+        dst += n;
+        src += n;
+        rem -= n;
+    }
+
+    while (rem > 0) {
+        /* The kernels only count in word 12. With the 64-bit counter the
+         * buffer is cut where word 12 wraps, so that each piece has a single
+         * value in word 13. */
+        uint64_t n = rem;
+        uint64_t left = (1ULL << 32) - (uint32_t)counter;
+        if (state.counter64 && (n - 1) / 64 >= left)
+            n = left * 64;
+
+        AddBlockCount(&state, counter);
+        counter += n / 64;
+        rem -= n;
+
+        /* Each kernel in the chain takes as much of the buffer as fits its
+         * batch size, the scalar kernel at the end of every chain does the
+         * rest. */
+        for (int kern = active_kernel; ; kern = kernels[kern].next) {
+            uint64_t done = kernels[kern].fn[variant](&state, dst, src, n);
+            dst += done;
+            src += done;
+            n -= done;
+            if (kern == KERNEL_SCALAR)
+                break;
         }
+    }
+
+    return 0;
+}
+
+int ChaCha20EncryptAt(const ChaCha20Context* ctx, void* data,
+        const uint64_t size, const uint64_t offset) {
+    return EncryptRange(ctx, data, data, size, offset);
+}
+
+int ChaCha20Encrypt(const ChaCha20Context* ctx, void* data,
+        const uint64_t size) {
+    return EncryptRange(ctx, data, data, size, 0);
+}
+
+#ifdef CHACHA20_X86_SIMD
+/* Copies size bytes to dst with non-temporal stores. They write whole lines
+ * to memory without reading them into the cache first, and without evicting
+ * data that is still needed to make room for output that is not. */
+static void StreamStore(uint8_t* dst, const uint8_t* src, uint64_t size) {
+    uint64_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > size)
+        head = size;
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+    }
+
+    for (; size >= 16; size -= 16, dst += 16, src += 16)
+        _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+
+    memcpy(dst, src, size);
+}
+#endif
+
+/* Large outputs are produced NT_TILE bytes at a time into a buffer that stays
+ * in L1, from where StreamStore() moves them to dst. */
+#define NT_TILE 8192
+
+int ChaCha20EncryptTo(const ChaCha20Context* ctx, void* dst, const void* src,
+        const uint64_t size) {
+    if (CheckRange(ctx, size, 0) != 0)
+        return -1;
 
-        uint8_t carry = 0;
-        for (int j = 0; j <= used; j++) {
-            uint16_t sum = ((uint16_t)tag[i]) + ((uint16_t)n[i]) + carry;
-            if (sum > 0xff)
-                carry = 1;
-            else
-                carry = 0;
+#ifdef CHACHA20_X86_SIMD
+    if (size >= nt_min) {
+        uint8_t tile[NT_TILE] __attribute__((aligned(64)));
+        uint8_t* d = dst;
+        const uint8_t* s = src;
+        for (uint64_t off = 0; off < size; off += NT_TILE) {
+            uint64_t n = (size - off < NT_TILE) ? size - off : NT_TILE;
+            EncryptRange(ctx, tile, s + off, n, off);
+            StreamStore(d + off, tile, n);
         }
+
+        // Non-temporal stores are weakly ordered, finish them before returning
+        _mm_sfence();
+        return 0;
+    }
+#endif
+
+    return EncryptRange(ctx, dst, src, size, 0);
+}
+
+int Encrypt(void* data, const uint64_t size, const void* key,
+        const void* nonce) {
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    return ChaCha20Encrypt(&ctx, data, size);
+}
+
+/* Runs fn(arg, i) for i = 0 .. n - 1 in parallel and returns when all of
+ * them are done. fn is always run for every index, also where threads are
+ * not available. */
+typedef void (*ParallelFn)(void* arg, int index);
+
+#ifndef CHACHA20_NO_THREADS
+/* The work goes to a pool of threads that is started on first use, grows
+ * up to the largest n asked for and is then kept for the life of the
+ * process, so a call does not pay for creating threads. The calling thread
+ * takes indices too, in the same way as the workers: a call finishes even
+ * if no worker gets to run. One call uses the pool at a time, a call made
+ * while it is busy starts threads of its own instead. */
+typedef struct Pool {
+    pthread_mutex_t busy;  // held by the call using the pool
+    pthread_mutex_t lock;  // guards everything below
+    pthread_cond_t  work;
+    pthread_cond_t  done;
+    ParallelFn      fn;
+    void*           arg;
+    uint64_t        job;   // incremented for every call
+    int             n;
+    int             next;  // next index to run
+    int             left;  // indices not finished yet
+    int             threads;
+} Pool;
+
+static Pool pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0,
+    0, 0 };
+
+// Runs indices of the current job until there are none left, with the lock
+static void PoolRun(void) {
+    while (pool.next < pool.n) {
+        int index = pool.next++;
+        ParallelFn fn = pool.fn;
+        void* arg = pool.arg;
+        pthread_mutex_unlock(&pool.lock);
+        fn(arg, index);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.left == 0)
+            pthread_cond_signal(&pool.done);
+    }
+}
+
+/* arg is the job number from before the call that created the thread, so
+ * the thread also takes part in that call. */
+static void* PoolThread(void* arg) {
+    uint64_t seen = (uint64_t)(uintptr_t)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.job == seen)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        seen = pool.job;
+        PoolRun();
+    }
+    return NULL;
+}
+
+typedef struct ParallelTask {
+    ParallelFn fn;
+    void*      arg;
+    int        index;
+} ParallelTask;
+
+static void* ParallelThread(void* t) {
+    ParallelTask* task = t;
+    task->fn(task->arg, task->index);
+    return NULL;
+}
+
+// The fallback while the pool is busy: one thread per index, as in the pool
+static void SpawnParallel(ParallelFn fn, void* arg, const int n) {
+    pthread_t    threads[CHACHA20_MAX_THREADS];
+    ParallelTask tasks[CHACHA20_MAX_THREADS];
+    int          started[CHACHA20_MAX_THREADS];
+
+    for (int i = 1; i < n; i++) {
+        tasks[i].fn = fn;
+        tasks[i].arg = arg;
+        tasks[i].index = i;
+        started[i] = pthread_create(&threads[i], NULL, ParallelThread,
+                &tasks[i]) == 0;
+    }
+
+    fn(arg, 0);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(arg, i);
     }
 }
+#endif
 
+static void RunParallel(ParallelFn fn, void* arg, const int n) {
+#ifndef CHACHA20_NO_THREADS
+    if (pthread_mutex_trylock(&pool.busy) != 0) {
+        SpawnParallel(fn, arg, n);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.threads < n - 1) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, PoolThread,
+                    (void*)(uintptr_t)pool.job) != 0)
+            break;
+        pthread_detach(thread);
+        pool.threads++;
+    }
 
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.n = n;
+    pool.next = 0;
+    pool.left = n;
+    pool.job++;
+    pthread_cond_broadcast(&pool.work);
 
+    PoolRun();
+    while (pool.left > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+#else
+    for (int i = 0; i < n; i++)
+        fn(arg, i);
+#endif
+}
+
+/* Number of threads worth using for size bytes when each thread should get
+ * at least min_chunk bytes. threads == 0 means one per online CPU. */
+static int ThreadCount(int threads, const uint64_t size,
+        const uint64_t min_chunk) {
+#ifndef CHACHA20_NO_THREADS
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads > CHACHA20_MAX_THREADS)
+        threads = CHACHA20_MAX_THREADS;
+
+    if ((uint64_t)threads > size / min_chunk)
+        threads = (int)(size / min_chunk);
+
+    return (threads < 1) ? 1 : threads;
+}
+
+typedef struct EncryptJob {
+    const ChaCha20Context* ctx;
+    uint8_t*               data;
+    uint64_t               size;
+    uint64_t               chunk; // multiple of 64, so chunks start on a block
+} EncryptJob;
+
+static void EncryptChunk(void* arg, const int index) {
+    EncryptJob* job = arg;
+    uint64_t start = index * job->chunk;
+    if (start >= job->size)
+        return;
+
+    uint64_t len = job->size - start;
+    if (len > job->chunk)
+        len = job->chunk;
+
+    ChaCha20EncryptAt(job->ctx, job->data + start, len, start);
+}
+
+int ChaCha20EncryptParallel(const ChaCha20Context* ctx, void* data,
+        const uint64_t size, const int threads) {
+    /* Blocks are independent, so the buffer is cut into one block aligned
+     * chunk per thread and every thread seeks to its own counter. Below
+     * CHACHA20_PARALLEL_MIN bytes per thread the thread start-up costs more
+     * than it saves and everything stays on the calling thread. */
+    if (CheckRange(ctx, size, 0) != 0)
+        return -1;
+
+    int n = ThreadCount(threads, size, CHACHA20_PARALLEL_MIN);
+    if (n == 1)
+        return ChaCha20Encrypt(ctx, data, size);
+
+    EncryptJob job = { ctx, data, size, 0 };
+    job.chunk = ((size + n - 1) / n + 63) & ~(uint64_t)63;
+    RunParallel(EncryptChunk, &job, n);
+    return 0;
+}
+
+
+static void Poly1305GenKey(const ChaCha20Context* ctx, uint8_t otk[32]) {
+    /*
+     * poly1305_key_gen(key,nonce):
+     *   counter = 0
+     *   block = chacha20_block(key,counter,nonce)
+     *   return block[0..31]
+     *   end */
+    CryptState state;
+    LoadState(&state, ctx);
+    AddBlockCount(&state, 0);
+    ChaCha20Block(&state, 20);
+    memcpy(otk, state.cc_state, 32);
+}
+
+/* Clears key material in a way the compiler can not drop as a dead store.
+ * With GCC and clang the stores are plain ones that can be vectorized, an
+ * empty asm statement that might read the memory keeps them alive. */
+static void Wipe(void* p, uint64_t size) {
+#if defined(__GNUC__) || defined(__clang__)
+    uint8_t* b = p;
+    for (uint64_t i = 0; i < size; i++)
+        b[i] = 0;
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+#else
+    volatile uint8_t* v = p;
+    while (size > 0)
+        v[--size] = 0;
+#endif
+}
+
+/* Only the bytes around block boundaries that an update call starts or ends
+ * in go through stream->keystream, everything in between is handed to
+ * ChaCha20EncryptAt() and so to the wide kernels. */
+void ChaCha20StreamInit(ChaCha20Stream* stream, const ChaCha20Context* ctx) {
+    stream->ctx = *ctx;
+    stream->offset = 0;
+    stream->leftover = 0;
+}
+
+int ChaCha20StreamUpdate(ChaCha20Stream* stream, void* d, uint64_t size) {
+    uint8_t* data = d;
+    if (CheckRange(&stream->ctx, size, stream->offset) != 0)
+        return -1;
+
+    // Use up the rest of the block the previous call ended in
+    uint64_t n = (stream->leftover < size) ? stream->leftover : size;
+    const uint8_t* ks = stream->keystream + 64 - stream->leftover;
+    for (uint64_t i = 0; i < n; i++)
+        data[i] ^= ks[i];
+
+    stream->leftover -= n;
+    stream->offset += n;
+    data += n;
+    size -= n;
+
+    uint64_t bulk = size & ~(uint64_t)63;
+    ChaCha20EncryptAt(&stream->ctx, data, bulk, stream->offset);
+    stream->offset += bulk;
+    data += bulk;
+    size -= bulk;
+
+    // Keep the keystream of a block that is only partly used
+    if (size > 0) {
+        for (int i = 0; i < 64; i++)
+            stream->keystream[i] = 0;
+        ChaCha20EncryptAt(&stream->ctx, stream->keystream, 64,
+                stream->offset);
+        for (uint64_t i = 0; i < size; i++)
+            data[i] ^= stream->keystream[i];
+
+        stream->leftover = 64 - size;
+        stream->offset += size;
+    }
+
+    return 0;
+}
+
+void ChaCha20StreamFinal(ChaCha20Stream* stream) {
+    Wipe(stream, sizeof(*stream));
+}
+
+/* HChaCha20 as specified in draft-irtf-cfrg-xchacha section 2.2. The state is
+ * set up like a ChaCha20 block, with the 16 byte nonce taking the place of
+ * the counter and the 12 byte nonce:
+ *
+ *   cccccccc  cccccccc  cccccccc  cccccccc
+ *   kkkkkkkk  kkkkkkkk  kkkkkkkk  kkkkkkkk
+ *   kkkkkkkk  kkkkkkkk  kkkkkkkk  kkkkkkkk
+ *   nnnnnnnn  nnnnnnnn  nnnnnnnn  nnnnnnnn
+ *
+ * After the 20 rounds the state is not added back. The subkey is the first
+ * and the last row of the result, which are the parts of the state that do
+ * not depend on the key alone. */
+void HChaCha20(uint8_t subkey[32], const void* key, const void* nonce) {
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, NULL);
+    memcpy(&ctx.state[12], nonce, 4 * sizeof(uint32_t));
+
+    ChaCha20Rounds(ctx.state, 20);
+
+    memcpy(subkey, &ctx.state[0], 16);
+    memcpy(subkey + 16, &ctx.state[12], 16);
+    Wipe(&ctx, sizeof(ctx));
+}
+
+/* Same rounds with one nonce per lane of the active kernel, a partial last
+ * batch simply leaves some of the lanes unused. */
+void HChaCha20Batch(uint8_t* subkeys, const void* key, const void* nonces,
+        const uint64_t count) {
+    const Kernel* kern = &kernels[active_kernel];
+    const uint64_t width = kern->width;
+    const uint8_t* n = nonces;
+    ChaCha20Context ctx;
+    uint32_t x[16][MAX_KERNEL_WIDTH];
+    ChaCha20Init(&ctx, key, NULL);
+
+    for (uint64_t done = 0; done < count; done += width) {
+        uint64_t lanes = (count - done < width) ? count - done : width;
+        for (int i = 0; i < 12; i++) {
+            for (uint64_t j = 0; j < width; j++)
+                x[i][j] = ctx.state[i];
+        }
+        for (uint64_t j = 0; j < width; j++) {
+            for (int i = 0; i < 4; i++) {
+                if (j < lanes)
+                    memcpy(&x[12 + i][j], n + 16 * (done + j) + 4 * i, 4);
+                else
+                    x[12 + i][j] = 0;
+            }
+        }
+
+        kern->rounds(x, NULL);
+
+        for (uint64_t j = 0; j < lanes; j++) {
+            uint8_t* out = subkeys + 32 * (done + j);
+            for (int i = 0; i < 4; i++) {
+                memcpy(out + 4 * i, &x[i][j], 4);
+                memcpy(out + 16 + 4 * i, &x[12 + i][j], 4);
+            }
+        }
+    }
+
+    Wipe(x, sizeof(x));
+    Wipe(&ctx, sizeof(ctx));
+}
+
+/* XChaCha20 is ChaCha20 under the HChaCha20 subkey of the first 16 nonce
+ * bytes, with the remaining 8 bytes as the last 8 bytes of a 12 byte nonce
+ * whose first 4 bytes are zero. */
+void XChaCha20Init(ChaCha20Context* ctx, const void* key, const void* nonce) {
+    uint8_t subkey[32];
+    HChaCha20(subkey, key, nonce);
+    ChaCha20Init(ctx, subkey, NULL);
+    Wipe(subkey, sizeof(subkey));
+
+    ctx->state[13] = 0;
+    memcpy(&ctx->state[14], (const uint8_t*)nonce + 16, 2 * sizeof(uint32_t));
+}
+
+int XChaCha20Encrypt(void* data, const uint64_t size, const void* key,
+        const void* nonce) {
+    ChaCha20Context ctx;
+    XChaCha20Init(&ctx, key, nonce);
+    int ret = ChaCha20Encrypt(&ctx, data, size);
+    Wipe(&ctx, sizeof(ctx));
+    return ret;
+}
+
+/* The multi-buffer manager keeps one job per lane of the kernel that was
+ * active when it was initialized. Lane j has the input state of its job in
+ * column j of mgr->state, the word-sliced layout of the rounds kernels, so
+ * one call of the rounds kernel makes the next block of every lane. Blocks
+ * are only made once every lane is taken, or when the manager is flushed.
+ * Finished jobs wait in mgr->done until Submit or Flush hands them back.
+ * The column of a finished job is left for the next job to overwrite, the
+ * states are only wiped once a flush finds the manager empty: clearing the
+ * 16 strided words of each column cost as much as the XOR of a block. */
+void ChaCha20ManagerInit(ChaCha20Manager* mgr) {
+    mgr->kernel = active_kernel;
+    mgr->width = kernels[active_kernel].width;
+    mgr->busy = 0;
+    mgr->first_done = 0;
+    mgr->ndone = 0;
+    for (int j = 0; j < CHACHA20_MAX_LANES; j++) {
+        mgr->lanes[j] = NULL;
+        for (int i = 0; i < 16; i++)
+            mgr->state[i][j] = 0;
+    }
+}
+
+/* At most every lane finishes in one run while the job being submitted is
+ * rejected, so the ring of finished jobs never holds more than this. */
+#define DONE_RING (CHACHA20_MAX_LANES + 1)
+
+static void ManagerRetire(ChaCha20Manager* mgr, ChaCha20Job* job,
+        const int status) {
+    job->status = status;
+    mgr->done[(mgr->first_done + mgr->ndone++) % DONE_RING] = job;
+}
+
+static ChaCha20Job* ManagerNext(ChaCha20Manager* mgr) {
+    if (mgr->ndone == 0)
+        return NULL;
+
+    ChaCha20Job* job = mgr->done[mgr->first_done];
+    mgr->first_done = (mgr->first_done + 1) % DONE_RING;
+    mgr->ndone--;
+    return job;
+}
+
+static void XorBlock(uint8_t* data, const uint8_t* ks, const uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t d, k;
+        memcpy(&d, data + i, 8);
+        memcpy(&k, ks + i, 8);
+        d ^= k;
+        memcpy(data + i, &d, 8);
+    }
+    for (; i < n; i++)
+        data[i] ^= ks[i];
+}
+
+/* Makes as many blocks for all lanes as the shortest job still needs, which
+ * finishes at least that job. */
+static void ManagerRun(ChaCha20Manager* mgr) {
+    const Kernel* kern = &kernels[mgr->kernel];
+    uint8_t ks[64 * MAX_KERNEL_WIDTH];
+    uint64_t blocks = ~0ULL;
+    for (int j = 0; j < mgr->width; j++) {
+        ChaCha20Job* job = mgr->lanes[j];
+        if (job != NULL) {
+            uint64_t left = (job->size - mgr->pos[j] + 63) / 64;
+            blocks = (left < blocks) ? left : blocks;
+        }
+    }
+
+    for (uint64_t b = 0; b < blocks; b++) {
+        kern->rounds(mgr->state, ks);
+
+        for (int j = 0; j < mgr->width; j++) {
+            ChaCha20Job* job = mgr->lanes[j];
+            if (job == NULL)
+                continue;
+
+            uint64_t n = job->size - mgr->pos[j];
+            XorBlock((uint8_t*)job->data + mgr->pos[j], ks + 64 * j,
+                    (n < 64) ? n : 64);
+            mgr->pos[j] += (n < 64) ? n : 64;
+
+            // Next block, carrying into word 13 with the 64-bit counter
+            if (++mgr->state[12][j] == 0 && job->ctx->counter64)
+                mgr->state[13][j]++;
+        }
+    }
+    Wipe(ks, 64 * mgr->width);
+
+    for (int j = 0; j < mgr->width; j++) {
+        ChaCha20Job* job = mgr->lanes[j];
+        if (job != NULL && mgr->pos[j] == job->size) {
+            mgr->lanes[j] = NULL;
+            mgr->busy--;
+            ManagerRetire(mgr, job, 0);
+        }
+    }
+}
+
+ChaCha20Job* ChaCha20ManagerSubmit(ChaCha20Manager* mgr, ChaCha20Job* job) {
+    const ChaCha20Context* ctx = job->ctx;
+    if (ctx->rounds != 20 || CheckRange(ctx, job->size, 0) != 0) {
+        ManagerRetire(mgr, job, -1);
+        return ManagerNext(mgr);
+    }
+    if (job->size == 0) {
+        ManagerRetire(mgr, job, 0);
+        return ManagerNext(mgr);
+    }
+
+    int lane = 0;
+    while (mgr->lanes[lane] != NULL)
+        lane++;
+
+    mgr->lanes[lane] = job;
+    mgr->pos[lane] = 0;
+    for (int i = 0; i < 16; i++)
+        mgr->state[i][lane] = ctx->state[i];
+
+    if (++mgr->busy == mgr->width)
+        ManagerRun(mgr);
+
+    return ManagerNext(mgr);
+}
+
+ChaCha20Job* ChaCha20ManagerFlush(ChaCha20Manager* mgr) {
+    if (mgr->ndone > 0)
+        return ManagerNext(mgr);
+
+    if (mgr->busy == 0) {
+        Wipe(mgr->state, sizeof(mgr->state));
+        return NULL;
+    }
+
+    /* A job left on its own gains nothing from the other lanes, the bulk
+     * kernels finish it faster. */
+    if (mgr->busy == 1) {
+        int last = 0;
+        while (mgr->lanes[last] == NULL)
+            last++;
+
+        ChaCha20Job* job = mgr->lanes[last];
+        ChaCha20EncryptAt(job->ctx, (uint8_t*)job->data + mgr->pos[last],
+                job->size - mgr->pos[last], mgr->pos[last]);
+        mgr->lanes[last] = NULL;
+        mgr->busy--;
+        ManagerRetire(mgr, job, 0);
+    } else {
+        ManagerRun(mgr);
+    }
+
+    return ManagerNext(mgr);
+}
+
+/* Poly1305 as specified in RFC 8439 section 2.5. The 130 bit accumulator and
+ * r are kept in three 64 bit limbs of 44, 44 and 42 bits, so that a limb
+ * product fits comfortably in 128 bits and the sum of three of them does not
+ * overflow either. Reduction mod P = 2^130 - 5 uses 2^130 = 5 (mod P): the
+ * parts of the product above bit 130 are multiplied by 5 and added back at
+ * the bottom. All of it is done without branches or table lookups on secret
+ * data, so the timing does not depend on the key or the message. */
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+typedef unsigned __int128 uint128_t;
+
+// Shortest run of full blocks worth handing to the AVX2 code
+#define POLY1305_AVX2_MIN 256
+
+static uint64_t Load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void Store64(uint8_t* p, const uint64_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static ALWAYS_INLINE void Poly1305Clamp(uint64_t r[3], const uint8_t* key) {
+    uint64_t t0 = Load64(key);
+    uint64_t t1 = Load64(key + 8);
+
+    /* r is clamped as required by the RFC (r &=
+     * 0x0ffffffc0ffffffc0ffffffc0fffffff) while splitting it into limbs */
+    r[0] = t0 & 0xffc0fffffffULL;
+    r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+}
+
+void Poly1305Init(Poly1305Context* ctx, const uint8_t key[32]) {
+    Poly1305Clamp(ctx->r, key);
+
+    ctx->h[0] = 0;
+    ctx->h[1] = 0;
+    ctx->h[2] = 0;
+
+    // s is only added at the very end
+    ctx->pad[0] = Load64(key + 16);
+    ctx->pad[1] = Load64(key + 24);
+
+    ctx->leftover = 0;
+    ctx->have_powers = 0;
+}
+
+// h = h * r (mod P), partially reduced like the accumulator in the loop below
+static void Poly1305Mul(uint64_t h[3], const uint64_t r[3]) {
+    const uint64_t s1 = r[1] * (5 << 2);
+    const uint64_t s2 = r[2] * (5 << 2);
+
+    uint128_t d0 = (uint128_t)h[0] * r[0] + (uint128_t)h[1] * s2 +
+        (uint128_t)h[2] * s1;
+    uint128_t d1 = (uint128_t)h[0] * r[1] + (uint128_t)h[1] * r[0] +
+        (uint128_t)h[2] * s2;
+    uint128_t d2 = (uint128_t)h[0] * r[2] + (uint128_t)h[1] * r[1] +
+        (uint128_t)h[2] * r[0];
+
+    uint64_t c = (uint64_t)(d0 >> 44);
+    h[0] = (uint64_t)d0 & MASK44;
+    d1 += c;
+    c = (uint64_t)(d1 >> 44);
+    h[1] = (uint64_t)d1 & MASK44;
+    d2 += c;
+    c = (uint64_t)(d2 >> 42);
+    h[2] = (uint64_t)d2 & MASK42;
+    h[0] += c * 5;
+    c = h[0] >> 44;
+    h[0] &= MASK44;
+    h[1] += c;
+}
+
+#ifdef CHACHA20_X86_SIMD
+/* AVX2 Poly1305 processing 4 blocks (64 bytes) per iteration.
+ *
+ * The scalar loop is a chain of dependent multiplications, one per block. To
+ * break it up, the message is split into 4 interleaved streams: lane j takes
+ * blocks j, j + 4, j + 8, ... and computes h_j = (h_j + m) * r^4 for each of
+ * them. The last group is multiplied by r^4, r^3, r^2 and r^1 instead, which
+ * gives every block the same power of r it would get in the serial loop, so
+ * the sum of the 4 lanes is the serial result.
+ *
+ * vpmuludq only multiplies 32 bit halves, so numbers are kept in 5 limbs of
+ * 26 bits, held in the 64 bit lanes of 5 vectors. Products stay below 2^59
+ * which leaves room for the sums and the * 5 of the reduction. */
+#define MASK26 0x3ffffffULL
+
+// Splits a 130 bit number from 44 bit limbs into 26 bit limbs
+static void Radix26(const uint64_t h[3], uint64_t l[5]) {
+    uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+    uint64_t c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+
+    l[0] = h0 & MASK26;
+    l[1] = ((h0 >> 26) | (h1 << 18)) & MASK26;
+    l[2] = (h1 >> 8) & MASK26;
+    l[3] = ((h1 >> 34) | (h2 << 10)) & MASK26;
+    l[4] = h2 >> 16;
+}
+
+static void Poly1305Powers(Poly1305Context* ctx) {
+    uint64_t p[3] = { ctx->r[0], ctx->r[1], ctx->r[2] };
+    for (int i = 0; i < 4; i++) {
+        uint64_t l[5];
+        Radix26(p, l);
+        for (int j = 0; j < 5; j++)
+            ctx->powers[i][j] = (uint32_t)l[j];
+        Poly1305Mul(p, ctx->r);
+    }
+
+    ctx->have_powers = 1;
+}
+
+// h = h * r, with s = 5 * r precomputed
+AVX2_TARGET static inline void MulAVX2(__m256i h[5], const __m256i r[5],
+        const __m256i s[5]) {
+    __m256i d[5];
+    d[0] = _mm256_add_epi64(
+            _mm256_add_epi64(_mm256_mul_epu32(h[0], r[0]),
+                _mm256_mul_epu32(h[1], s[4])),
+            _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], s[3]),
+                    _mm256_mul_epu32(h[3], s[2])),
+                _mm256_mul_epu32(h[4], s[1])));
+    d[1] = _mm256_add_epi64(
+            _mm256_add_epi64(_mm256_mul_epu32(h[0], r[1]),
+                _mm256_mul_epu32(h[1], r[0])),
+            _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], s[4]),
+                    _mm256_mul_epu32(h[3], s[3])),
+                _mm256_mul_epu32(h[4], s[2])));
+    d[2] = _mm256_add_epi64(
+            _mm256_add_epi64(_mm256_mul_epu32(h[0], r[2]),
+                _mm256_mul_epu32(h[1], r[1])),
+            _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], r[0]),
+                    _mm256_mul_epu32(h[3], s[4])),
+                _mm256_mul_epu32(h[4], s[3])));
+    d[3] = _mm256_add_epi64(
+            _mm256_add_epi64(_mm256_mul_epu32(h[0], r[3]),
+                _mm256_mul_epu32(h[1], r[2])),
+            _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], r[1]),
+                    _mm256_mul_epu32(h[3], r[0])),
+                _mm256_mul_epu32(h[4], s[4])));
+    d[4] = _mm256_add_epi64(
+            _mm256_add_epi64(_mm256_mul_epu32(h[0], r[4]),
+                _mm256_mul_epu32(h[1], r[3])),
+            _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(h[2], r[2]),
+                    _mm256_mul_epu32(h[3], r[1])),
+                _mm256_mul_epu32(h[4], r[0])));
+
+    /* Partial reduction, limbs end up at most slightly above 26 bits. The
+     * carries run as two interleaved chains, d0 -> d1 -> d2 -> d3 and
+     * d3 -> d4 -> d0 -> d1, to shorten the dependency chain. */
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    __m256i c0, c3;
+    c0 = _mm256_srli_epi64(d[0], 26);
+    c3 = _mm256_srli_epi64(d[3], 26);
+    d[0] = _mm256_and_si256(d[0], mask);
+    d[3] = _mm256_and_si256(d[3], mask);
+    d[1] = _mm256_add_epi64(d[1], c0);
+    d[4] = _mm256_add_epi64(d[4], c3);
+
+    c0 = _mm256_srli_epi64(d[1], 26);
+    c3 = _mm256_srli_epi64(d[4], 26);
+    d[1] = _mm256_and_si256(d[1], mask);
+    d[4] = _mm256_and_si256(d[4], mask);
+    d[2] = _mm256_add_epi64(d[2], c0);
+    d[0] = _mm256_add_epi64(d[0], _mm256_add_epi64(c3,
+                _mm256_slli_epi64(c3, 2)));
+
+    c0 = _mm256_srli_epi64(d[2], 26);
+    c3 = _mm256_srli_epi64(d[0], 26);
+    d[2] = _mm256_and_si256(d[2], mask);
+    d[0] = _mm256_and_si256(d[0], mask);
+    d[3] = _mm256_add_epi64(d[3], c0);
+    d[1] = _mm256_add_epi64(d[1], c3);
+
+    c0 = _mm256_srli_epi64(d[3], 26);
+    d[3] = _mm256_and_si256(d[3], mask);
+    d[4] = _mm256_add_epi64(d[4], c0);
+
+    h[0] = d[0];
+    h[1] = d[1];
+    h[2] = d[2];
+    h[3] = d[3];
+    h[4] = d[4];
+}
+
+// h += the 4 blocks at m, one per lane
+AVX2_TARGET static inline void AddBlocksAVX2(__m256i h[5], const uint8_t* m) {
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    __m256i m0 = _mm256_loadu_si256((const __m256i*)m);
+    __m256i m1 = _mm256_loadu_si256((const __m256i*)(m + 32));
+
+    // Low and high 64 bits of blocks 0..3, in lane order after the permute
+    __m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(m0, m1),
+            0xd8);
+    __m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(m0, m1),
+            0xd8);
+
+    h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, mask));
+    h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(
+                _mm256_srli_epi64(lo, 26), mask));
+    h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(_mm256_or_si256(
+                    _mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)),
+                mask));
+    h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(
+                _mm256_srli_epi64(hi, 14), mask));
+    h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40),
+                _mm256_set1_epi64x(1 << 24)));
+}
+
+/* Processes size / 64 groups of 4 full blocks and returns the number of bytes
+ * done. The accumulator is moved into lane 0 on entry and the lanes are
+ * summed back into ctx->h at the end. */
+AVX2_TARGET static uint64_t Poly1305BlocksAVX2(Poly1305Context* ctx,
+        const uint8_t* m, const uint64_t size) {
+    uint64_t groups = size / 64;
+    if (groups == 0)
+        return 0;
+
+    if (!ctx->have_powers)
+        Poly1305Powers(ctx);
+
+    __m256i r4[5], s4[5], rl[5], sl[5], h[5];
+    uint64_t l[5];
+    Radix26(ctx->h, l);
+    for (int i = 0; i < 5; i++) {
+        // r^4 in every lane for the loop, r^4 .. r^1 for the last group
+        r4[i] = _mm256_set1_epi64x(ctx->powers[3][i]);
+        rl[i] = _mm256_setr_epi64x(ctx->powers[3][i], ctx->powers[2][i],
+                ctx->powers[1][i], ctx->powers[0][i]);
+        s4[i] = _mm256_add_epi64(r4[i], _mm256_slli_epi64(r4[i], 2));
+        sl[i] = _mm256_add_epi64(rl[i], _mm256_slli_epi64(rl[i], 2));
+        h[i] = _mm256_setr_epi64x(l[i], 0, 0, 0);
+    }
+
+    for (uint64_t g = 0; g < groups - 1; g++, m += 64) {
+        AddBlocksAVX2(h, m);
+        MulAVX2(h, r4, s4);
+    }
+
+    AddBlocksAVX2(h, m);
+    MulAVX2(h, rl, sl);
+
+    // Sum the lanes and carry the result back into 44 bit limbs
+    uint64_t t[5];
+    for (int i = 0; i < 5; i++) {
+        __m128i v = _mm_add_epi64(_mm256_castsi256_si128(h[i]),
+                _mm256_extracti128_si256(h[i], 1));
+        t[i] = (uint64_t)_mm_cvtsi128_si64(v) +
+            (uint64_t)_mm_extract_epi64(v, 1);
+    }
+
+    uint64_t c;
+    for (int i = 0; i < 4; i++) {
+        c = t[i] >> 26;
+        t[i] &= MASK26;
+        t[i + 1] += c;
+    }
+    c = t[4] >> 26;
+    t[4] &= MASK26;
+    t[0] += c * 5;
+    c = t[0] >> 26;
+    t[0] &= MASK26;
+    t[1] += c;
+
+    uint64_t a = t[0] + (t[1] << 26);
+    ctx->h[0] = a & MASK44;
+    a = (a >> 44) + (t[2] << 8) + (t[3] << 34);
+    ctx->h[1] = a & MASK44;
+    ctx->h[2] = (a >> 44) + (t[4] << 16);
+
+    return groups * 64;
+}
+#endif
+
+/* Processes size / 16 full blocks. hibit is the bit set just above the 16
+ * message bytes (2^128, bit 40 of the top limb), it is 0 only for the final
+ * partial block that is padded by hand. */
+static void Poly1305Blocks(Poly1305Context* ctx, const uint8_t* m,
+        uint64_t size, const uint64_t hibit) {
+#ifdef CHACHA20_X86_SIMD
+    /* Long runs of full blocks go through the 4-way AVX2 code. Below
+     * POLY1305_AVX2_MIN bytes the conversions in and out of it cost more than
+     * the parallel lanes win. */
+    if (size >= POLY1305_AVX2_MIN && hibit != 0 && KernelHasAVX2()) {
+        uint64_t done = Poly1305BlocksAVX2(ctx, m, size);
+        m += done;
+        size -= done;
+    }
+#endif
+
+    const uint64_t r0 = ctx->r[0];
+    const uint64_t r1 = ctx->r[1];
+    const uint64_t r2 = ctx->r[2];
+
+    // Parts of the product that land at 2^132 and up are folded back * 20
+    const uint64_t s1 = r1 * (5 << 2);
+    const uint64_t s2 = r2 * (5 << 2);
+
+    uint64_t h0 = ctx->h[0];
+    uint64_t h1 = ctx->h[1];
+    uint64_t h2 = ctx->h[2];
+
+    while (size >= 16) {
+        // h += m[i]
+        uint64_t t0 = Load64(m);
+        uint64_t t1 = Load64(m + 8);
+        h0 += t0 & MASK44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+        h2 += ((t1 >> 24) & MASK42) | hibit;
+
+        // h *= r
+        uint128_t d0 = (uint128_t)h0 * r0 + (uint128_t)h1 * s2 +
+            (uint128_t)h2 * s1;
+        uint128_t d1 = (uint128_t)h0 * r1 + (uint128_t)h1 * r0 +
+            (uint128_t)h2 * s2;
+        uint128_t d2 = (uint128_t)h0 * r2 + (uint128_t)h1 * r1 +
+            (uint128_t)h2 * r0;
+
+        // (partial) h %= p
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & MASK44;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & MASK44;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & MASK42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= MASK44;
+        h1 += c;
+
+        m += 16;
+        size -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+}
+
+void Poly1305Update(Poly1305Context* ctx, const void* msg, uint64_t size) {
+    const uint8_t* m = msg;
+
+    // Complete a partial block left over from the previous call first
+    if (ctx->leftover != 0) {
+        uint64_t want = 16 - ctx->leftover;
+        if (want > size)
+            want = size;
+
+        memcpy(ctx->buffer + ctx->leftover, m, want);
+        ctx->leftover += want;
+        m += want;
+        size -= want;
+        if (ctx->leftover < 16)
+            return;
+
+        Poly1305Blocks(ctx, ctx->buffer, 16, 1ULL << 40);
+        ctx->leftover = 0;
+    }
+
+    if (size >= 16) {
+        uint64_t want = size & ~(uint64_t)15;
+        Poly1305Blocks(ctx, m, want, 1ULL << 40);
+        m += want;
+        size -= want;
+    }
+
+    if (size > 0) {
+        memcpy(ctx->buffer, m, size);
+        ctx->leftover = size;
+    }
+}
+
+/* If the last block is shorter than 16 bytes the 0x01 byte is appended
+ * right after it and the rest is zero padded. */
+static void Poly1305Pad(Poly1305Context* ctx) {
+    if (ctx->leftover != 0) {
+        ctx->buffer[ctx->leftover] = 1;
+        for (uint64_t i = ctx->leftover + 1; i < 16; i++)
+            ctx->buffer[i] = 0;
+        Poly1305Blocks(ctx, ctx->buffer, 16, 0);
+        ctx->leftover = 0;
+    }
+}
+
+void Poly1305Final(Poly1305Context* ctx, uint8_t tag[16]) {
+    Poly1305Pad(ctx);
+
+    // Fully carry h
+    uint64_t h0 = ctx->h[0];
+    uint64_t h1 = ctx->h[1];
+    uint64_t h2 = ctx->h[2];
+
+    uint64_t c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+
+    // g = h + -p = h - (2^130 - 5)
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= MASK44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= MASK44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+
+    // Select h if h < p and g = h - p otherwise, without branching
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    // tag = (h + s) % 2^128
+    uint64_t t0 = ctx->pad[0];
+    uint64_t t1 = ctx->pad[1];
+
+    h0 += t0 & MASK44;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += ((t1 >> 24) & MASK42) + c;
+    h2 &= MASK42;
+
+    Store64(tag, h0 | (h1 << 44));
+    Store64(tag + 8, (h1 >> 20) | (h2 << 24));
+
+    // The key must not be reused, so don't leave it or the message behind
+    Wipe(ctx, sizeof(*ctx));
+}
+
+void Poly1305(uint8_t tag[16], const void* msg, const uint64_t size,
+        const uint8_t key[32]) {
+    Poly1305Context ctx;
+    Poly1305Init(&ctx, key);
+    Poly1305Update(&ctx, msg, size);
+    Poly1305Final(&ctx, tag);
+}
+
+/* Multi-buffer Poly1305. A single message only keeps the lanes of
+ * Poly1305BlocksAVX2() busy once it is a few hundred bytes long, so short
+ * messages are instead given a lane each, with their own r and s. A MacLane
+ * is the MAC input of one message as up to 3 segments: the message itself
+ * for Poly1305Batch(), or aad, ciphertext and lengths for the AEAD, where
+ * every segment is zero padded to a full block. */
+#define POLY1305_LANES 8
+
+// Messages that Poly1305Lanes() hands to the lanes at a time
+#define POLY1305_CHUNK 32
+
+typedef struct MacLane {
+    const uint8_t* seg[3];
+    uint64_t       len[3];
+    int            nseg;
+    int            aead;
+    const uint8_t* key;
+    uint8_t*       tag;
+} MacLane;
+
+/* Feeds the lane's input from byte off of segment seg on to mac, which
+ * already holds everything before it, and writes the tag. */
+static void MacLaneFinish(const MacLane* lane, Poly1305Context* mac,
+        const int seg, const uint64_t off) {
+    static const uint8_t zeros[16] = { 0 };
+    for (int i = seg; i < lane->nseg; i++) {
+        uint64_t from = (i == seg) ? off : 0;
+        Poly1305Update(mac, lane->seg[i] + from, lane->len[i] - from);
+        if (lane->aead)
+            Poly1305Update(mac, zeros, (16 - lane->len[i] % 16) % 16);
+    }
+
+    Poly1305Final(mac, lane->tag);
+}
+
+#ifdef CHACHA20_X86_SIMD
+/* With AVX-512 IFMA the 8 lanes are the 64 bit lanes of one vector per limb,
+ * in the same 44, 44 and 42 bit limbs as the scalar code. vpmadd52luq and
+ * vpmadd52huq add the low and the high 52 bits of the product of two limbs,
+ * so a block takes 18 of them for all 8 lanes where the scalar code needs 9
+ * multiplications per lane. Radix 2^26 code with plain AVX2 multiplies is
+ * not faster than the scalar code with one lane per message, so there is
+ * none.
+ *
+ * Up to POLY1305_CHUNK messages go through the lanes, which run in lock
+ * step. When a message is done its lane is given the next one. A lane
+ * without a message is multiplied by r = 1 with a zero block, which leaves
+ * its h as it is. Once fewer than POLY1305_LANES_MIN messages are left this
+ * stops, leaving hs[k] with the accumulator of each message k that is not
+ * done and seg[k] and off[k] at the input it has not processed yet, the
+ * caller finishes those with Poly1305Update(), which is faster for a lone
+ * long message. That part is kept out of the AVX-512 code because SSE
+ * instructions run with a large penalty while the upper halves of the
+ * vector registers are dirty. The messages that are done have seg[k] set to
+ * their number of segments and their tag written. */
+#define POLY1305_LANES_MIN 3
+
+#define IFMA_TARGET __attribute__((target("avx512f,avx512ifma")))
+
+// h = h * r (mod P) in every lane, partially reduced like Poly1305Mul()
+IFMA_TARGET static inline void MulIFMA(__m512i h[3], const __m512i r[3],
+        const __m512i s[3]) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i lo0 = _mm512_madd52lo_epu64(zero, h[0], r[0]);
+    __m512i hi0 = _mm512_madd52hi_epu64(zero, h[0], r[0]);
+    __m512i lo1 = _mm512_madd52lo_epu64(zero, h[0], r[1]);
+    __m512i hi1 = _mm512_madd52hi_epu64(zero, h[0], r[1]);
+    __m512i lo2 = _mm512_madd52lo_epu64(zero, h[0], r[2]);
+    __m512i hi2 = _mm512_madd52hi_epu64(zero, h[0], r[2]);
+    lo0 = _mm512_madd52lo_epu64(lo0, h[1], s[2]);
+    hi0 = _mm512_madd52hi_epu64(hi0, h[1], s[2]);
+    lo1 = _mm512_madd52lo_epu64(lo1, h[1], r[0]);
+    hi1 = _mm512_madd52hi_epu64(hi1, h[1], r[0]);
+    lo2 = _mm512_madd52lo_epu64(lo2, h[1], r[1]);
+    hi2 = _mm512_madd52hi_epu64(hi2, h[1], r[1]);
+    lo0 = _mm512_madd52lo_epu64(lo0, h[2], s[1]);
+    hi0 = _mm512_madd52hi_epu64(hi0, h[2], s[1]);
+    lo1 = _mm512_madd52lo_epu64(lo1, h[2], s[2]);
+    hi1 = _mm512_madd52hi_epu64(hi1, h[2], s[2]);
+    lo2 = _mm512_madd52lo_epu64(lo2, h[2], r[0]);
+    hi2 = _mm512_madd52hi_epu64(hi2, h[2], r[0]);
+
+    // Limb i is lo_i + hi_i * 2^52, the carries out of it start at bit 44
+    const __m512i mask44 = _mm512_set1_epi64(MASK44);
+    const __m512i mask42 = _mm512_set1_epi64(MASK42);
+    __m512i c;
+    h[0] = _mm512_and_si512(lo0, mask44);
+    c = _mm512_add_epi64(_mm512_srli_epi64(lo0, 44),
+            _mm512_slli_epi64(hi0, 8));
+    lo1 = _mm512_add_epi64(lo1, c);
+    h[1] = _mm512_and_si512(lo1, mask44);
+    c = _mm512_add_epi64(_mm512_srli_epi64(lo1, 44),
+            _mm512_slli_epi64(hi1, 8));
+    lo2 = _mm512_add_epi64(lo2, c);
+    h[2] = _mm512_and_si512(lo2, mask42);
+    c = _mm512_add_epi64(_mm512_srli_epi64(lo2, 42),
+            _mm512_slli_epi64(hi2, 10));
+    h[0] = _mm512_add_epi64(h[0], _mm512_add_epi64(c,
+                _mm512_slli_epi64(c, 2)));
+    c = _mm512_srli_epi64(h[0], 44);
+    h[0] = _mm512_and_si512(h[0], mask44);
+    h[1] = _mm512_add_epi64(h[1], c);
+}
+
+/* h += the 16 byte blocks at p[0..7], one per lane. hibit is 2^128 in the
+ * top limb (1 << 40) or 0 in each lane. */
+IFMA_TARGET static inline void AddBlocksIFMA(__m512i h[3],
+        const uint8_t* const p[8], const __m512i hibit) {
+    __m128i x[8];
+    for (int i = 0; i < 8; i++)
+        x[i] = _mm_loadu_si128((const __m128i*)p[i]);
+
+    __m512i a = _mm512_castsi128_si512(x[0]);
+    __m512i b = _mm512_castsi128_si512(x[1]);
+    a = _mm512_inserti32x4(a, x[2], 1);
+    b = _mm512_inserti32x4(b, x[3], 1);
+    a = _mm512_inserti32x4(a, x[4], 2);
+    b = _mm512_inserti32x4(b, x[5], 2);
+    a = _mm512_inserti32x4(a, x[6], 3);
+    b = _mm512_inserti32x4(b, x[7], 3);
+
+    // Low and high 64 bits of the blocks in lane order
+    __m512i lo = _mm512_unpacklo_epi64(a, b);
+    __m512i hi = _mm512_unpackhi_epi64(a, b);
+    const __m512i mask44 = _mm512_set1_epi64(MASK44);
+    h[0] = _mm512_add_epi64(h[0], _mm512_and_si512(lo, mask44));
+    h[1] = _mm512_add_epi64(h[1], _mm512_and_si512(_mm512_or_si512(
+                    _mm512_srli_epi64(lo, 44), _mm512_slli_epi64(hi, 20)),
+                mask44));
+    h[2] = _mm512_add_epi64(h[2], _mm512_or_si512(_mm512_srli_epi64(hi, 24),
+                hibit));
+}
+
+/* The tags of all lanes, finishing h and adding s as Poly1305Final() does.
+ * The low and high 64 bits of the tag of lane j go to lo[j] and hi[j]. */
+IFMA_TARGET static inline void TagsIFMA(const __m512i h[3],
+        const uint64_t s[2][POLY1305_LANES], uint64_t lo[POLY1305_LANES],
+        uint64_t hi[POLY1305_LANES]) {
+    const __m512i mask44 = _mm512_set1_epi64(MASK44);
+    const __m512i mask42 = _mm512_set1_epi64(MASK42);
+    __m512i h0 = h[0], h1 = h[1], h2 = h[2], c;
+
+    // Fully carry h
+    for (int i = 0; i < 2; i++) {
+        c = _mm512_srli_epi64(h1, 44);
+        h1 = _mm512_and_si512(h1, mask44);
+        h2 = _mm512_add_epi64(h2, c);
+        c = _mm512_srli_epi64(h2, 42);
+        h2 = _mm512_and_si512(h2, mask42);
+        h0 = _mm512_add_epi64(h0, _mm512_add_epi64(c,
+                    _mm512_slli_epi64(c, 2)));
+        c = _mm512_srli_epi64(h0, 44);
+        h0 = _mm512_and_si512(h0, mask44);
+        h1 = _mm512_add_epi64(h1, c);
+    }
+
+    // g = h - p, selected where it does not go below zero
+    __m512i g0 = _mm512_add_epi64(h0, _mm512_set1_epi64(5));
+    c = _mm512_srli_epi64(g0, 44);
+    g0 = _mm512_and_si512(g0, mask44);
+    __m512i g1 = _mm512_add_epi64(h1, c);
+    c = _mm512_srli_epi64(g1, 44);
+    g1 = _mm512_and_si512(g1, mask44);
+    __m512i g2 = _mm512_sub_epi64(_mm512_add_epi64(h2, c),
+            _mm512_set1_epi64(1LL << 42));
+    __mmask8 below = _mm512_cmplt_epi64_mask(g2, _mm512_setzero_si512());
+    h0 = _mm512_mask_blend_epi64(below, g0, h0);
+    h1 = _mm512_mask_blend_epi64(below, g1, h1);
+    h2 = _mm512_mask_blend_epi64(below, g2, h2);
+
+    // tag = (h + s) % 2^128
+    __m512i t0 = _mm512_loadu_si512(s[0]);
+    __m512i t1 = _mm512_loadu_si512(s[1]);
+    h0 = _mm512_add_epi64(h0, _mm512_and_si512(t0, mask44));
+    c = _mm512_srli_epi64(h0, 44);
+    h0 = _mm512_and_si512(h0, mask44);
+    h1 = _mm512_add_epi64(h1, _mm512_add_epi64(_mm512_and_si512(
+                    _mm512_or_si512(_mm512_srli_epi64(t0, 44),
+                        _mm512_slli_epi64(t1, 20)), mask44), c));
+    c = _mm512_srli_epi64(h1, 44);
+    h1 = _mm512_and_si512(h1, mask44);
+    h2 = _mm512_add_epi64(h2, _mm512_add_epi64(_mm512_and_si512(
+                    _mm512_srli_epi64(t1, 24), mask42), c));
+    h2 = _mm512_and_si512(h2, mask42);
+
+    _mm512_storeu_si512(lo, _mm512_or_si512(h0, _mm512_slli_epi64(h1, 44)));
+    _mm512_storeu_si512(hi, _mm512_or_si512(_mm512_srli_epi64(h1, 20),
+                _mm512_slli_epi64(h2, 24)));
+}
+
+IFMA_TARGET static void MacLanesIFMA(const MacLane* lanes, const int count,
+        int* seg, uint64_t* off, uint64_t (*hs)[3]) {
+    static const uint8_t zero_block[16] = { 0 };
+    uint64_t left[POLY1305_CHUNK];
+    uint64_t r[3][POLY1305_LANES], s[2][POLY1305_LANES], t[3][POLY1305_LANES];
+    uint64_t hb[POLY1305_LANES], inc[POLY1305_LANES];
+    const uint8_t* p[POLY1305_LANES];
+    uint8_t pad[POLY1305_LANES][16];
+    int slot[POLY1305_LANES], order[POLY1305_CHUNK];
+    __m512i h[3], rv[3], sv[3];
+    int next = 0;
+
+    /* Messages are started from the shortest to the longest, so that the
+     * lanes tend to reach the ends of their segments together. */
+    for (int k = 0; k < count; k++) {
+        left[k] = 0;
+        seg[k] = 0;
+        off[k] = 0;
+        for (int i = 0; i < lanes[k].nseg; i++)
+            left[k] += (lanes[k].len[i] + 15) / 16;
+
+        int i = k;
+        for (; i > 0 && left[order[i - 1]] > left[k]; i--)
+            order[i] = order[i - 1];
+        order[i] = k;
+    }
+    for (int j = 0; j < POLY1305_LANES; j++) {
+        slot[j] = -1;
+        r[0][j] = 1;
+        r[1][j] = r[2][j] = 0;
+        s[0][j] = s[1][j] = 0;
+    }
+    for (int i = 0; i < 3; i++)
+        h[i] = _mm512_setzero_si512();
+
+    for (;;) {
+        // Write the tags of finished messages and start the next ones
+        int finished = 0, fresh = 0;
+        for (int j = 0; j < POLY1305_LANES; j++) {
+            if (slot[j] >= 0 && left[slot[j]] == 0)
+                finished |= 1 << j;
+        }
+        if (finished != 0)
+            TagsIFMA(h, s, t[0], t[1]);
+
+        for (int j = 0; j < POLY1305_LANES; j++) {
+            if ((finished >> j) & 1) {
+                const int k = slot[j];
+                Store64(lanes[k].tag, t[0][j]);
+                Store64(lanes[k].tag + 8, t[1][j]);
+                seg[k] = lanes[k].nseg;
+                slot[j] = -1;
+                r[0][j] = 1;
+                r[1][j] = r[2][j] = 0;
+            }
+            if (slot[j] >= 0)
+                continue;
+
+            // The tag of an empty message is s
+            while (next < count && left[order[next]] == 0) {
+                const int k = order[next++];
+                memcpy(lanes[k].tag, lanes[k].key + 16, 16);
+                seg[k] = lanes[k].nseg;
+            }
+            if (next < count) {
+                const int k = order[next++];
+                uint64_t rk[3];
+                Poly1305Clamp(rk, lanes[k].key);
+                for (int i = 0; i < 3; i++)
+                    r[i][j] = rk[i];
+                s[0][j] = Load64(lanes[k].key + 16);
+                s[1][j] = Load64(lanes[k].key + 24);
+                slot[j] = k;
+                fresh |= 1 << j;
+            }
+        }
+
+        if ((finished | fresh) != 0) {
+            for (int i = 0; i < 3; i++) {
+                h[i] = _mm512_maskz_mov_epi64((__mmask8)~fresh, h[i]);
+                rv[i] = _mm512_loadu_si512(r[i]);
+                sv[i] = _mm512_add_epi64(_mm512_slli_epi64(rv[i], 4),
+                        _mm512_slli_epi64(rv[i], 2));
+            }
+        }
+
+        /* Lanes with a message, and the full blocks that all of them have
+         * in their current segment */
+        int busy = 0;
+        uint64_t run = ~0ULL;
+        for (int j = 0; j < POLY1305_LANES; j++) {
+            const int k = slot[j];
+            if (k < 0)
+                continue;
+
+            while (off[k] == lanes[k].len[seg[k]]) {
+                seg[k]++;
+                off[k] = 0;
+            }
+            uint64_t full = (lanes[k].len[seg[k]] - off[k]) / 16;
+            run = (full < run) ? full : run;
+            busy++;
+        }
+        if (busy < POLY1305_LANES_MIN)
+            break;
+
+        /* The full blocks all lanes have, otherwise one block per lane,
+         * copied and padded where it is the partial end of a segment. */
+        uint64_t blocks = (run > 0) ? run : 1;
+        for (int j = 0; j < POLY1305_LANES; j++) {
+            const int k = slot[j];
+            hb[j] = 0;
+            inc[j] = 0;
+            p[j] = zero_block;
+            if (k < 0)
+                continue;
+
+            const MacLane* lane = &lanes[k];
+            const uint8_t* m = lane->seg[seg[k]] + off[k];
+            uint64_t rem = lane->len[seg[k]] - off[k];
+            hb[j] = 1ULL << 40;
+            p[j] = m;
+            if (rem < 16) {
+                for (int i = 0; i < 16; i++)
+                    pad[j][i] = 0;
+                memcpy(pad[j], m, rem);
+                if (!lane->aead) {
+                    pad[j][rem] = 1;
+                    hb[j] = 0;
+                }
+                p[j] = pad[j];
+                off[k] += rem;
+            } else {
+                inc[j] = 16;
+                off[k] += 16 * blocks;
+            }
+            left[k] -= blocks;
+        }
+
+        const __m512i hibit = _mm512_loadu_si512(hb);
+        for (uint64_t b = 0; b < blocks; b++) {
+            AddBlocksIFMA(h, p, hibit);
+            MulIFMA(h, rv, sv);
+            for (int j = 0; j < POLY1305_LANES; j++)
+                p[j] += inc[j];
+        }
+    }
+
+    // The few messages that are left continue from where they are
+    for (int i = 0; i < 3; i++)
+        _mm512_storeu_si512(t[i], h[i]);
+    for (int j = 0; j < POLY1305_LANES; j++) {
+        if (slot[j] >= 0) {
+            for (int i = 0; i < 3; i++)
+                hs[slot[j]][i] = t[i][j];
+        }
+    }
+
+    Wipe(r, sizeof(r));
+    Wipe(s, sizeof(s));
+    Wipe(t, sizeof(t));
+    Wipe(pad, sizeof(pad));
+}
+#endif
+
+static void Poly1305Lanes(const MacLane* lanes, const uint64_t count) {
+    uint64_t i = 0;
+#ifdef CHACHA20_X86_SIMD
+    if (KernelHasIFMA()) {
+        int seg[POLY1305_CHUNK];
+        uint64_t off[POLY1305_CHUNK], hs[POLY1305_CHUNK][3];
+        for (; i + POLY1305_LANES_MIN <= count; i += POLY1305_CHUNK) {
+            int n = (count - i < POLY1305_CHUNK) ? (int)(count - i) :
+                POLY1305_CHUNK;
+            MacLanesIFMA(lanes + i, n, seg, off, hs);
+
+            for (int k = 0; k < n; k++) {
+                const MacLane* lane = &lanes[i + k];
+                if (seg[k] == lane->nseg)
+                    continue;
+
+                Poly1305Context mac;
+                Poly1305Init(&mac, lane->key);
+                for (int l = 0; l < 3; l++)
+                    mac.h[l] = hs[k][l];
+                MacLaneFinish(lane, &mac, seg[k], off[k]);
+            }
+        }
+        Wipe(hs, sizeof(hs));
+    }
+#endif
+
+    for (; i < count; i++) {
+        Poly1305Context mac;
+        Poly1305Init(&mac, lanes[i].key);
+        MacLaneFinish(&lanes[i], &mac, 0, 0);
+    }
+}
+
+void Poly1305Batch(uint8_t* tags, const void* const* msgs,
+        const uint64_t* sizes, const uint8_t* keys, const uint64_t count) {
+    MacLane lanes[POLY1305_CHUNK];
+    for (uint64_t done = 0; done < count; done += POLY1305_CHUNK) {
+        uint64_t n = (count - done < POLY1305_CHUNK) ? count - done :
+            POLY1305_CHUNK;
+        for (uint64_t j = 0; j < n; j++) {
+            lanes[j].seg[0] = msgs[done + j];
+            lanes[j].len[0] = sizes[done + j];
+            lanes[j].nseg = 1;
+            lanes[j].aead = 0;
+            lanes[j].key = keys + 32 * (done + j);
+            lanes[j].tag = tags + 16 * (done + j);
+        }
+
+        Poly1305Lanes(lanes, n);
+    }
+}
+
+void Poly1305MAC(uint8_t tag[16], const void* msg, const uint64_t size,
+        const void* key, const void* nonce) {
+    ChaCha20Context ctx;
+    uint8_t otk[32];
+    ChaCha20Init(&ctx, key, nonce);
+    Poly1305GenKey(&ctx, otk);
+    Poly1305(tag, msg, size, otk);
+    Wipe(otk, sizeof(otk));
+}
+
+/* AEAD_CHACHA20_POLY1305 as specified in RFC 8439 section 2.8:
+ *
+ * chacha20_aead_encrypt(aad, key, iv, constant, plaintext):
+ *   nonce = constant | iv
+ *   otk = poly1305_key_gen(key, nonce)
+ *   ciphertext = chacha20_encrypt(key, 1, nonce, plaintext)
+ *   mac_data = aad | pad16(aad)
+ *   mac_data |= ciphertext | pad16(ciphertext)
+ *   mac_data |= num_to_8_le_bytes(aad.length)
+ *   mac_data |= num_to_8_le_bytes(ciphertext.length)
+ *   tag = poly1305_mac(mac_data, otk)
+ *   return (ciphertext, tag)
+ *
+ * mac_data is never built in memory, the pieces are fed to Poly1305 one
+ * after the other. AEADStart() takes everything up to the ciphertext and
+ * AEADFinish() everything after it. */
+/* Encrypting everything and then running Poly1305 over the ciphertext reads
+ * the whole buffer from memory twice, which for buffers larger than the
+ * caches doubles the memory traffic. Instead the buffer is processed in
+ * tiles of AEAD_TILE bytes that fit in L1: a tile is encrypted and then
+ * authenticated while it is still in the cache. A multiple of 64 keeps the
+ * tiles on block boundaries. Open cannot do the same, a tile decrypted in
+ * place would hand out plaintext before the tag over the whole message has
+ * been checked, so it authenticates all of the ciphertext first and only
+ * decrypts it after that. */
+#define AEAD_TILE 16384
+
+static void AEADStart(Poly1305Context* mac, const uint8_t otk[32],
+        const void* aad, const uint64_t aad_size) {
+    static const uint8_t zeros[16] = { 0 };
+    Poly1305Init(mac, otk);
+    Poly1305Update(mac, aad, aad_size);
+    Poly1305Update(mac, zeros, (16 - aad_size % 16) % 16);
+}
+
+static void AEADFinish(Poly1305Context* mac, const uint64_t aad_size,
+        const uint64_t size, uint8_t tag[16]) {
+    static const uint8_t zeros[16] = { 0 };
+    uint8_t lengths[16];
+    Store64(lengths, aad_size);
+    Store64(lengths + 8, size);
+
+    Poly1305Update(mac, zeros, (16 - size % 16) % 16);
+    Poly1305Update(mac, lengths, 16);
+    Poly1305Final(mac, tag);
+}
+
+/* Encrypts and authenticates the next size bytes of the message in tiles of
+ * AEAD_TILE bytes. */
+static void AEADUpdate(Poly1305Context* mac, ChaCha20Stream* stream,
+        uint8_t* data, const uint64_t size) {
+    for (uint64_t off = 0; off < size; off += AEAD_TILE) {
+        uint64_t n = (size - off < AEAD_TILE) ? size - off : AEAD_TILE;
+        ChaCha20StreamUpdate(stream, data + off, n);
+        Poly1305Update(mac, data + off, n);
+    }
+}
+
+// Compares two tags in constant time, returns 1 if they are equal
+static int TagEquals(const uint8_t* a, const uint8_t* b) {
+    uint32_t diff = 0;
+    for (int i = 0; i < 16; i++)
+        diff |= a[i] ^ b[i];
+
+    return (int)(1 & ((diff - 1) >> 8));
+}
+
+
+/* For short messages the one-time key would cost a whole ChaCha20Block()
+ * call of its own, followed by a separate kernel call for counters 1 and up.
+ * If block 0 and the message fit in one batch of the active SIMD kernel, a
+ * single call over [64 zero bytes | data] covering counters 0 .. width - 1
+ * produces both: ks[0..31] is the Poly1305 key and ks[64..] the en- or
+ * decrypted data. Returns the number of bytes of ks used, which the caller
+ * must wipe, or 0 if the message is too long for that (or the kernel is the
+ * scalar one). */
+static uint64_t AEADSingleBatch(const ChaCha20Context* ctx,
+        const uint8_t* data, const uint64_t size,
+        uint8_t ks[64 * MAX_KERNEL_WIDTH]) {
+    const Kernel* kern = &kernels[active_kernel];
+    const uint64_t n = 64 * kern->width;
+    if (kern->width == 1 || size + 64 > n)
+        return 0;
+
+    for (int i = 0; i < 64; i++)
+        ks[i] = 0;
+    memcpy(ks + 64, data, size);
+    for (uint64_t i = 64 + size; i < n; i++)
+        ks[i] = 0;
+
+    CryptState state;
+    LoadState(&state, ctx);
+    AddBlockCount(&state, 0);
+    kern->fn[0](&state, ks, ks, n);
+    return n;
+}
+
+int ChaCha20Poly1305Seal(void* d, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        uint8_t tag[16]) {
+    uint8_t* data = d;
+    ChaCha20Context ctx;
+    ChaCha20Stream stream;
+    Poly1305Context mac;
+    uint8_t otk[32], ks[64 * MAX_KERNEL_WIDTH];
+    ChaCha20Init(&ctx, key, nonce);
+    if (CheckRange(&ctx, size, 0) != 0)
+        return -1;
+
+    uint64_t used = AEADSingleBatch(&ctx, data, size, ks);
+    if (used != 0) {
+        AEADStart(&mac, ks, aad, aad_size);
+        memcpy(data, ks + 64, size);
+        Wipe(ks, used);
+        Poly1305Update(&mac, data, size);
+        AEADFinish(&mac, aad_size, size, tag);
+        return 0;
+    }
+
+    Poly1305GenKey(&ctx, otk);
+    AEADStart(&mac, otk, aad, aad_size);
+    Wipe(otk, sizeof(otk));
+
+    ChaCha20StreamInit(&stream, &ctx);
+    AEADUpdate(&mac, &stream, data, size);
+    ChaCha20StreamFinal(&stream);
+
+    AEADFinish(&mac, aad_size, size, tag);
+    return 0;
+}
+
+int ChaCha20Poly1305Open(void* d, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        const uint8_t tag[16]) {
+    uint8_t* data = d;
+    ChaCha20Context ctx;
+    Poly1305Context mac;
+    uint8_t otk[32], computed[16], ks[64 * MAX_KERNEL_WIDTH];
+    ChaCha20Init(&ctx, key, nonce);
+    if (CheckRange(&ctx, size, 0) != 0)
+        return -1;
+
+    /* Short messages are decrypted into ks and only copied out once the
+     * tag over the untouched ciphertext in data has been checked. */
+    uint64_t used = AEADSingleBatch(&ctx, data, size, ks);
+    if (used != 0) {
+        AEADStart(&mac, ks, aad, aad_size);
+        Wipe(ks, 32);
+        Poly1305Update(&mac, data, size);
+        AEADFinish(&mac, aad_size, size, computed);
+        if (!TagEquals(computed, tag)) {
+            Wipe(ks, used);
+            return -1;
+        }
+
+        memcpy(data, ks + 64, size);
+        Wipe(ks, used);
+        return 0;
+    }
+
+    Poly1305GenKey(&ctx, otk);
+    AEADStart(&mac, otk, aad, aad_size);
+    Wipe(otk, sizeof(otk));
+
+    // All of the ciphertext is authenticated before any of it is decrypted
+    Poly1305Update(&mac, data, size);
+    AEADFinish(&mac, aad_size, size, computed);
+    if (!TagEquals(computed, tag))
+        return -1;
+
+    return ChaCha20Encrypt(&ctx, data, size);
+}
+
+/* Parallel Poly1305. The accumulator after n blocks is
+ *
+ *   h = m_1 * r^n + m_2 * r^(n-1) + ... + m_n * r (mod P)
+ *
+ * so a message cut into chunks of k blocks can be hashed chunk by chunk from
+ * h = 0, and the partial results combined as h = h * r^k + h_chunk in order
+ * of the chunks. Only r^k and the power for the shorter last chunk are
+ * needed, and they come from a few squarings. Chunks are a multiple of 64
+ * bytes, so only the last one ends with a partial block. The parallel Seal
+ * also encrypts each chunk on the same thread, tile by tile like
+ * AEADUpdate(). */
+typedef struct MacJob {
+    const ChaCha20Context* ctx;   // NULL to only authenticate
+    uint8_t*               data;
+    uint64_t               size;
+    uint64_t               chunk; // multiple of 64
+    const uint8_t*         key;   // one-time key
+    int                    aead;  // zero pad the last block as the AEAD does
+    uint64_t               (*h)[3];
+} MacJob;
+
+// p = r^e (mod P), partially reduced. e is a block count, not a secret.
+static void Poly1305Pow(uint64_t p[3], const uint64_t r[3], uint64_t e) {
+    uint64_t b[3] = { r[0], r[1], r[2] };
+    p[0] = 1;
+    p[1] = 0;
+    p[2] = 0;
+    for (; e != 0; e >>= 1) {
+        if (e & 1)
+            Poly1305Mul(p, b);
+        Poly1305Mul(b, b);
+    }
+    Wipe(b, sizeof(b));
+}
+
+static void MacChunk(void* arg, const int index) {
+    static const uint8_t zeros[16] = { 0 };
+    MacJob* job = arg;
+    uint64_t start = index * job->chunk;
+    if (start >= job->size)
+        return;
+
+    uint64_t len = job->size - start;
+    if (len > job->chunk)
+        len = job->chunk;
+
+    Poly1305Context mac;
+    Poly1305Init(&mac, job->key);
+    for (uint64_t off = 0; off < len; off += AEAD_TILE) {
+        uint64_t n = (len - off < AEAD_TILE) ? len - off : AEAD_TILE;
+        uint8_t* p = job->data + start + off;
+        if (job->ctx != NULL)
+            ChaCha20EncryptAt(job->ctx, p, n, start + off);
+        Poly1305Update(&mac, p, n);
+    }
+
+    if (job->aead)
+        Poly1305Update(&mac, zeros, (16 - len % 16) % 16);
+    Poly1305Pad(&mac);
+
+    for (int i = 0; i < 3; i++)
+        job->h[index][i] = mac.h[i];
+    Wipe(&mac, sizeof(mac));
+}
+
+/* Hashes the chunks of job on n threads and adds them to the accumulator of
+ * mac, as if Poly1305Update() had been called on the whole of job->data. */
+static void MacParallel(Poly1305Context* mac, MacJob* job, const int n) {
+    uint64_t h[CHACHA20_MAX_THREADS][3];
+    uint64_t rk[3], rl[3];
+    job->chunk = ((job->size + n - 1) / n + 63) & ~(uint64_t)63;
+    job->h = h;
+    RunParallel(MacChunk, job, n);
+
+    Poly1305Pow(rk, mac->r, job->chunk / 16);
+    for (uint64_t start = 0, i = 0; start < job->size; start += job->chunk) {
+        uint64_t len = job->size - start;
+        if (len >= job->chunk) {
+            Poly1305Mul(mac->h, rk);
+        } else {
+            Poly1305Pow(rl, mac->r, (len + 15) / 16);
+            Poly1305Mul(mac->h, rl);
+        }
+
+        for (int k = 0; k < 3; k++)
+            mac->h[k] += h[i][k];
+        i++;
+    }
+
+    Wipe(h, sizeof(h));
+    Wipe(rk, sizeof(rk));
+    Wipe(rl, sizeof(rl));
+}
+
+void Poly1305Parallel(uint8_t tag[16], const void* msg, const uint64_t size,
+        const uint8_t key[32], const int threads) {
+    int n = ThreadCount(threads, size, CHACHA20_PARALLEL_MIN);
+    if (n == 1) {
+        Poly1305(tag, msg, size, key);
+        return;
+    }
+
+    // data is only read when there is no ChaCha20 context
+    Poly1305Context mac;
+    MacJob job = { NULL, (uint8_t*)msg, size, 0, key, 0, NULL };
+    Poly1305Init(&mac, key);
+    MacParallel(&mac, &job, n);
+    Poly1305Final(&mac, tag);
+}
+
+/* The parallel AEAD cuts data into one chunk per thread, see MacParallel().
+ * Each thread encrypts its chunk first if encrypt is set, otherwise it only
+ * authenticates it. Everything after the ciphertext is added by the calling
+ * thread. */
+static void AEADParallel(const ChaCha20Context* ctx, uint8_t* data,
+        const uint64_t size, const void* aad, const uint64_t aad_size,
+        uint8_t tag[16], const int encrypt, const int n) {
+    Poly1305Context mac;
+    uint8_t otk[32], lengths[16];
+    Poly1305GenKey(ctx, otk);
+    AEADStart(&mac, otk, aad, aad_size);
+
+    MacJob job = { encrypt ? ctx : NULL, data, size, 0, otk, 1, NULL };
+    MacParallel(&mac, &job, n);
+    Wipe(otk, sizeof(otk));
+
+    Store64(lengths, aad_size);
+    Store64(lengths + 8, size);
+    Poly1305Update(&mac, lengths, 16);
+    Poly1305Final(&mac, tag);
+}
+
+int ChaCha20Poly1305SealParallel(void* data, const uint64_t size,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, uint8_t tag[16], const int threads) {
+    ChaCha20Context ctx;
+    int n = ThreadCount(threads, size, CHACHA20_PARALLEL_MIN);
+    if (n == 1) {
+        return ChaCha20Poly1305Seal(data, size, aad, aad_size, key, nonce,
+                tag);
+    }
+
+    ChaCha20Init(&ctx, key, nonce);
+    if (CheckRange(&ctx, size, 0) != 0)
+        return -1;
+
+    AEADParallel(&ctx, data, size, aad, aad_size, tag, 1, n);
+    return 0;
+}
+
+int ChaCha20Poly1305OpenParallel(void* data, const uint64_t size,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, const uint8_t tag[16], const int threads) {
+    ChaCha20Context ctx;
+    uint8_t computed[16];
+    int n = ThreadCount(threads, size, CHACHA20_PARALLEL_MIN);
+    if (n == 1) {
+        return ChaCha20Poly1305Open(data, size, aad, aad_size, key, nonce,
+                tag);
+    }
+
+    ChaCha20Init(&ctx, key, nonce);
+    if (CheckRange(&ctx, size, 0) != 0)
+        return -1;
+
+    // As in ChaCha20Poly1305Open(), nothing is decrypted before the tag check
+    AEADParallel(&ctx, data, size, aad, aad_size, computed, 0, n);
+    if (!TagEquals(computed, tag))
+        return -1;
+
+    return ChaCha20EncryptParallel(&ctx, data, size, n);
+}
+
+/* The batch functions take the jobs AEAD_BATCH at a time. The one-time keys
+ * and the en- or decryption of all of them go through a multi-buffer
+ * manager and the tags through Poly1305Lanes(), so short messages fill the
+ * SIMD lanes of both. Open only decrypts the jobs whose tag matched. */
+#define AEAD_BATCH 16
+
+static void AEADBatch(ChaCha20Poly1305Job* jobs, const uint64_t count,
+        const int open) {
+    ChaCha20Context ctx[AEAD_BATCH], key_ctx[AEAD_BATCH];
+    ChaCha20Job crypt[AEAD_BATCH], keygen[AEAD_BATCH];
+    uint8_t otk[AEAD_BATCH][32], lengths[AEAD_BATCH][16];
+    uint8_t computed[AEAD_BATCH][16];
+    MacLane lanes[AEAD_BATCH];
+    ChaCha20Manager mgr;
+    ChaCha20ManagerInit(&mgr);
+
+    for (uint64_t done = 0; done < count; done += AEAD_BATCH) {
+        ChaCha20Poly1305Job* batch = jobs + done;
+        int n = (count - done < AEAD_BATCH) ? (int)(count - done) :
+            AEAD_BATCH;
+        for (int j = 0; j < n; j++) {
+            ChaCha20Init(&ctx[j], batch[j].key, batch[j].nonce);
+            batch[j].status = CheckRange(&ctx[j], batch[j].size, 0);
+            if (batch[j].status != 0)
+                continue;
+
+            // poly1305_key_gen() is the first 32 bytes of block 0
+            key_ctx[j] = ctx[j];
+            ChaCha20SetCounter(&key_ctx[j], 0);
+            for (int i = 0; i < 32; i++)
+                otk[j][i] = 0;
+            keygen[j].ctx = &key_ctx[j];
+            keygen[j].data = otk[j];
+            keygen[j].size = 32;
+            ChaCha20ManagerSubmit(&mgr, &keygen[j]);
+
+            crypt[j].ctx = &ctx[j];
+            crypt[j].data = batch[j].data;
+            crypt[j].size = batch[j].size;
+            if (!open)
+                ChaCha20ManagerSubmit(&mgr, &crypt[j]);
+        }
+        while (ChaCha20ManagerFlush(&mgr) != NULL)
+            ;
+
+        int nl = 0;
+        for (int j = 0; j < n; j++) {
+            if (batch[j].status != 0)
+                continue;
+
+            Store64(lengths[j], batch[j].aad_size);
+            Store64(lengths[j] + 8, batch[j].size);
+            lanes[nl].seg[0] = batch[j].aad;
+            lanes[nl].len[0] = batch[j].aad_size;
+            lanes[nl].seg[1] = batch[j].data;
+            lanes[nl].len[1] = batch[j].size;
+            lanes[nl].seg[2] = lengths[j];
+            lanes[nl].len[2] = 16;
+            lanes[nl].nseg = 3;
+            lanes[nl].aead = 1;
+            lanes[nl].key = otk[j];
+            lanes[nl].tag = open ? computed[j] : batch[j].tag;
+            nl++;
+        }
+        Poly1305Lanes(lanes, nl);
+
+        if (open) {
+            for (int j = 0; j < n; j++) {
+                if (batch[j].status != 0)
+                    continue;
+                if (!TagEquals(computed[j], batch[j].tag))
+                    batch[j].status = -1;
+                else
+                    ChaCha20ManagerSubmit(&mgr, &crypt[j]);
+            }
+            while (ChaCha20ManagerFlush(&mgr) != NULL)
+                ;
+        }
+    }
+
+    Wipe(otk, sizeof(otk));
+    Wipe(ctx, sizeof(ctx));
+    Wipe(key_ctx, sizeof(key_ctx));
+}
+
+void ChaCha20Poly1305SealBatch(ChaCha20Poly1305Job* jobs,
+        const uint64_t count) {
+    AEADBatch(jobs, count, 0);
+}
+
+void ChaCha20Poly1305OpenBatch(ChaCha20Poly1305Job* jobs,
+        const uint64_t count) {
+    AEADBatch(jobs, count, 1);
+}
+
+/* AEAD_XChaCha20_Poly1305 (draft-irtf-cfrg-xchacha section 2.3) is the RFC
+ * 8439 construction under the XChaCha20 subkey and nonce. */
+static void XChaCha20Subkey(uint8_t subkey[32], uint8_t nonce12[12],
+        const void* key, const void* nonce) {
+    HChaCha20(subkey, key, nonce);
+    for (int i = 0; i < 4; i++)
+        nonce12[i] = 0;
+    memcpy(nonce12 + 4, (const uint8_t*)nonce + 16, 8);
+}
+
+int XChaCha20Poly1305Seal(void* data, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        uint8_t tag[16]) {
+    uint8_t subkey[32], nonce12[12];
+    XChaCha20Subkey(subkey, nonce12, key, nonce);
+    int ret = ChaCha20Poly1305Seal(data, size, aad, aad_size, subkey, nonce12,
+            tag);
+    Wipe(subkey, sizeof(subkey));
+    return ret;
+}
+
+int XChaCha20Poly1305Open(void* data, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        const uint8_t tag[16]) {
+    uint8_t subkey[32], nonce12[12];
+    XChaCha20Subkey(subkey, nonce12, key, nonce);
+    int ret = ChaCha20Poly1305Open(data, size, aad, aad_size, subkey, nonce12,
+            tag);
+    Wipe(subkey, sizeof(subkey));
+    return ret;
+}
+
+#ifndef CHACHA20_NO_IOVEC
+/* The vectored functions treat the segments of an iovec list as one message.
+ * They run a ChaCha20Stream over the segments, which carries the counter and
+ * the keystream of a block split between two segments over to the next one,
+ * while the whole blocks of each segment still go to the SIMD kernels. */
+
+// Total length of the list, or -1 if it does not fit in 64 bits
+static int IOVSize(const struct iovec* iov, const int iovcnt,
+        uint64_t* size) {
+    *size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > ~*size)
+            return -1;
+        *size += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+int ChaCha20EncryptIOV(const ChaCha20Context* ctx, const struct iovec* iov,
+        const int iovcnt) {
+    uint64_t size;
+    if (IOVSize(iov, iovcnt, &size) != 0 || CheckRange(ctx, size, 0) != 0)
+        return -1;
+
+    ChaCha20Stream stream;
+    ChaCha20StreamInit(&stream, ctx);
+    for (int i = 0; i < iovcnt; i++)
+        ChaCha20StreamUpdate(&stream, iov[i].iov_base, iov[i].iov_len);
+    ChaCha20StreamFinal(&stream);
+    return 0;
+}
+
+int ChaCha20Poly1305SealIOV(const struct iovec* iov, const int iovcnt,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, uint8_t tag[16]) {
+    ChaCha20Context ctx;
+    ChaCha20Stream stream;
+    Poly1305Context mac;
+    uint8_t otk[32];
+    uint64_t size;
+    ChaCha20Init(&ctx, key, nonce);
+    if (IOVSize(iov, iovcnt, &size) != 0 || CheckRange(&ctx, size, 0) != 0)
+        return -1;
+
+    Poly1305GenKey(&ctx, otk);
+    AEADStart(&mac, otk, aad, aad_size);
+    Wipe(otk, sizeof(otk));
+
+    ChaCha20StreamInit(&stream, &ctx);
+    for (int i = 0; i < iovcnt; i++)
+        AEADUpdate(&mac, &stream, iov[i].iov_base, iov[i].iov_len);
+    ChaCha20StreamFinal(&stream);
+
+    AEADFinish(&mac, aad_size, size, tag);
+    return 0;
+}
+
+int ChaCha20Poly1305OpenIOV(const struct iovec* iov, const int iovcnt,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, const uint8_t tag[16]) {
+    ChaCha20Context ctx;
+    Poly1305Context mac;
+    uint8_t otk[32], computed[16];
+    uint64_t size;
+    ChaCha20Init(&ctx, key, nonce);
+    if (IOVSize(iov, iovcnt, &size) != 0 || CheckRange(&ctx, size, 0) != 0)
+        return -1;
+
+    Poly1305GenKey(&ctx, otk);
+    AEADStart(&mac, otk, aad, aad_size);
+    Wipe(otk, sizeof(otk));
+
+    // As in ChaCha20Poly1305Open(), nothing is decrypted before the tag check
+    for (int i = 0; i < iovcnt; i++)
+        Poly1305Update(&mac, iov[i].iov_base, iov[i].iov_len);
+    AEADFinish(&mac, aad_size, size, computed);
+    if (!TagEquals(computed, tag))
+        return -1;
+
+    return ChaCha20EncryptIOV(&ctx, iov, iovcnt);
+}
+#endif
@@ -5,10 +5,302 @@
 
 // Copyright(C) 2025 Shivashish Das. Licensed under the MIT License
 
-void Encrypt(void* data, const uint64_t size, const void* key, 
+int Encrypt(void* data, const uint64_t size, const void* key, 
         const void* nonce);
 
 #define Decrypt(d, s, k, n) Encrypt(d, s, k, n);
+
+/* Precomputed ChaCha20 input state (constants | key | counter | nonce) so
+ * that encrypting many messages under one key does not set up the state
+ * again for every call or block. ChaCha20Init() may be given a NULL nonce
+ * when the nonce is only known per message, ChaCha20SetNonce() then only
+ * replaces the nonce words. The context is not modified by ChaCha20Encrypt()
+ * and can be shared between threads. */
+typedef struct ChaCha20Context {
+    uint32_t state[16];
+    int      counter64; // set by ChaCha20InitDJB()
+    int      rounds;    // 20 unless changed by ChaCha20SetRounds()
+} ChaCha20Context;
+
+void ChaCha20Init(ChaCha20Context* ctx, const void* key, const void* nonce);
+void ChaCha20SetNonce(ChaCha20Context* ctx, const void* nonce);
+int ChaCha20Encrypt(const ChaCha20Context* ctx, void* data,
+        const uint64_t size);
+
+/* ChaCha20InitDJB() sets up the original ChaCha20 instead, with an 8 byte
+ * nonce and a 64-bit block counter that starts at 0. A single nonce then
+ * covers 2^70 bytes instead of 256 GiB. Everything else, including the
+ * seekable and parallel functions, works the same on such a context, and
+ * ChaCha20SetNonce() takes 8 bytes for it. */
+void ChaCha20InitDJB(ChaCha20Context* ctx, const void* key,
+        const void* nonce);
+
+/* Switches a context to the reduced round variants ChaCha12 or ChaCha8
+ * (rounds 12 or 8), or back to ChaCha20 (20). They are considerably faster
+ * but have a much smaller security margin, so they are meant for uses like
+ * random number generation rather than protecting data against an attacker.
+ * Returns -1 for any other round count. The AEAD and XChaCha20 functions
+ * always use 20 rounds. */
+int ChaCha20SetRounds(ChaCha20Context* ctx, const int rounds);
+
+/* The keystream starts at block counter 1 as in Encrypt(), unless another
+ * initial counter is set with ChaCha20SetCounter(). ChaCha20EncryptAt()
+ * encrypts data as if it was found at the given byte offset of a message
+ * encrypted from that counter, so any range of a large message can be
+ * encrypted or decrypted without processing what comes before it.
+ * ChaCha20SetCounter64() returns -1 if the counter does not fit a context
+ * with a 32-bit counter.
+ *
+ * The encrypt functions never let the block counter wrap around, which would
+ * repeat the keystream. They return -1 without touching data if a block of
+ * the range would need a counter past 2^32 - 1 (2^64 - 1 with
+ * ChaCha20InitDJB()), and 0 otherwise. */
+void ChaCha20SetCounter(ChaCha20Context* ctx, const uint32_t counter);
+int ChaCha20SetCounter64(ChaCha20Context* ctx, const uint64_t counter);
+int ChaCha20EncryptAt(const ChaCha20Context* ctx, void* data,
+        const uint64_t size, const uint64_t offset);
+
+#define ChaCha20DecryptAt(c, d, s, o) ChaCha20EncryptAt(c, d, s, o)
+
+#define ChaCha20Decrypt(c, d, s) ChaCha20Encrypt(c, d, s)
+
+/* Same result as ChaCha20Encrypt(), but the buffer is split into block
+ * aligned chunks that are encrypted on up to threads threads (0 = one per
+ * online CPU). Every thread gets at least CHACHA20_PARALLEL_MIN bytes, so
+ * small buffers are encrypted on the calling thread only. */
+int ChaCha20EncryptParallel(const ChaCha20Context* ctx, void* data,
+        const uint64_t size, const int threads);
+
+#define ChaCha20DecryptParallel(c, d, s, t) ChaCha20EncryptParallel(c, d, s, t)
+
+/* Out-of-place ChaCha20Encrypt(): reads src and writes the result to dst in
+ * one pass, which saves copying data to dst first. src and dst must either
+ * be the same or not overlap. From CHACHA20_NT_MIN bytes on dst is written
+ * with non-temporal stores that bypass the caches. */
+int ChaCha20EncryptTo(const ChaCha20Context* ctx, void* dst, const void* src,
+        const uint64_t size);
+
+#define ChaCha20DecryptTo(c, d, s, n) ChaCha20EncryptTo(c, d, s, n)
+
+/* Streaming encryption for data that arrives in pieces of any size. Any
+ * sequence of ChaCha20StreamUpdate() calls gives the same bytes as a single
+ * ChaCha20Encrypt() over their concatenation with the context the stream was
+ * started from. The unused keystream of a block that an update ends in is
+ * kept for the next one. Update returns -1 without touching data if the
+ * counter would wrap. ChaCha20StreamFinal() wipes the stream. */
+typedef struct ChaCha20Stream {
+    ChaCha20Context ctx;
+    uint64_t        offset;   // bytes encrypted so far
+    uint8_t         keystream[64];
+    uint64_t        leftover; // unused bytes at the end of keystream
+} ChaCha20Stream;
+
+void ChaCha20StreamInit(ChaCha20Stream* stream, const ChaCha20Context* ctx);
+int ChaCha20StreamUpdate(ChaCha20Stream* stream, void* data, uint64_t size);
+void ChaCha20StreamFinal(ChaCha20Stream* stream);
+
+/* Multi-buffer manager for many short messages, each with its own context. A
+ * single message of a few hundred bytes leaves most lanes of the SIMD
+ * kernels idle, the manager instead puts the blocks of up to one message per
+ * lane into each kernel call. Jobs encrypt data in place like
+ * ChaCha20Encrypt(). ChaCha20ManagerSubmit() takes a job and returns a
+ * finished one, or NULL while all the jobs it holds are waiting for the
+ * lanes to fill up. ChaCha20ManagerFlush() makes progress without waiting
+ * for more jobs and returns a finished job, or NULL once the manager is
+ * empty, which also wipes the key material it holds. Every submitted job is
+ * returned exactly once, not necessarily in the order of submission, with
+ * status 0 when it was encrypted or -1 when it was rejected for the same
+ * reasons as ChaCha20Encrypt() or for a context with reduced rounds. The job
+ * and its context and data must stay valid until the job is returned. A
+ * manager uses the kernel that was active when it was initialized and must
+ * only be used by one thread at a time. */
+#define CHACHA20_MAX_LANES 16
+
+typedef struct ChaCha20Job {
+    const ChaCha20Context* ctx;
+    void*                  data;
+    uint64_t               size;
+    int                    status;    // set when the job is returned
+    void*                  user_data; // not used by the library
+} ChaCha20Job;
+
+typedef struct ChaCha20Manager {
+    ChaCha20Job* lanes[CHACHA20_MAX_LANES];
+    uint64_t     pos[CHACHA20_MAX_LANES]; // bytes done in each lane
+    uint32_t     state[16][CHACHA20_MAX_LANES];
+    ChaCha20Job* done[CHACHA20_MAX_LANES + 1]; // ring of finished jobs
+    int          first_done;
+    int          ndone;
+    int          busy; // lanes with a job
+    int          width;
+    int          kernel;
+} ChaCha20Manager;
+
+void ChaCha20ManagerInit(ChaCha20Manager* mgr);
+ChaCha20Job* ChaCha20ManagerSubmit(ChaCha20Manager* mgr, ChaCha20Job* job);
+ChaCha20Job* ChaCha20ManagerFlush(ChaCha20Manager* mgr);
+
+/* The keystream kernel (scalar, sse2, ssse3, avx2 or avx512) is picked for the
+ * host CPU when the library is loaded, or forced by setting the environment
+ * variable CHACHA20_KERNEL to one of those names. ChaCha20SetKernel() switches
+ * it at runtime and returns -1 if the kernel is unknown or not supported by
+ * the CPU. It must not be called while other threads are encrypting. */
+int ChaCha20SetKernel(const char* name);
+const char* ChaCha20KernelName(void);
+
+/* Poly1305 one-time authenticator (RFC 8439 section 2.5). Poly1305() computes
+ * the 16 byte tag of a message under a 32 byte one-time key (r | s), the
+ * Init/Update/Final functions do the same for a message that arrives in
+ * pieces. Poly1305MAC() derives the one-time key from a ChaCha20 key and
+ * nonce as in RFC 8439 section 2.6. A one-time key must never be used for
+ * more than one message. */
+typedef struct Poly1305Context {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+    uint8_t  buffer[16];
+    uint64_t leftover;
+    uint32_t powers[4][5]; // r^1 .. r^4 in radix 2^26 for the SIMD code
+    int      have_powers;
+} Poly1305Context;
+
+void Poly1305Init(Poly1305Context* ctx, const uint8_t key[32]);
+void Poly1305Update(Poly1305Context* ctx, const void* msg, uint64_t size);
+void Poly1305Final(Poly1305Context* ctx, uint8_t tag[16]);
+void Poly1305(uint8_t tag[16], const void* msg, const uint64_t size,
+        const uint8_t key[32]);
+void Poly1305MAC(uint8_t tag[16], const void* msg, const uint64_t size,
+        const void* key, const void* nonce);
+
+/* Same tag as Poly1305(), but the message is cut into chunks that are
+ * hashed on up to threads threads (0 = one per online CPU) and combined
+ * with powers of r. As with ChaCha20EncryptParallel() every thread gets at
+ * least CHACHA20_PARALLEL_MIN bytes. */
+void Poly1305Parallel(uint8_t tag[16], const void* msg, const uint64_t size,
+        const uint8_t key[32], const int threads);
+
+/* Poly1305Batch() computes the tags of count independent messages, the
+ * 16 byte tag of msgs[i] (sizes[i] bytes) under the 32 byte one-time key at
+ * keys + 32 * i goes to tags + 16 * i. With the avx512 kernel on CPUs with
+ * AVX-512 IFMA up to 8 messages are authenticated at once, one per SIMD
+ * lane, which beats one Poly1305() call after the other for messages of a
+ * few hundred bytes. Elsewhere it is the same as calling Poly1305(). */
+void Poly1305Batch(uint8_t* tags, const void* const* msgs,
+        const uint64_t* sizes, const uint8_t* keys, const uint64_t count);
+
+/* ChaCha20-Poly1305 AEAD (RFC 8439 section 2.8). Seal encrypts data in place
+ * and writes the 16 byte tag over the additional data (aad) and the
+ * ciphertext. Open checks the tag before it decrypts anything: it decrypts
+ * in place and returns 0 if the tag matches, or returns -1 and leaves data
+ * untouched if it does not, so no unauthenticated plaintext is ever written.
+ * Seal makes a single pass over data, Open one to authenticate and one to
+ * decrypt. Neither allocates memory. Messages longer than 2^38 - 64 bytes
+ * are rejected with -1 by both. */
+int ChaCha20Poly1305Seal(void* data, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        uint8_t tag[16]);
+int ChaCha20Poly1305Open(void* data, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        const uint8_t tag[16]);
+
+/* ChaCha20Poly1305Seal() and ChaCha20Poly1305Open() on up to threads
+ * threads, with the same results. Each thread authenticates and en- or
+ * decrypts its own chunk of data. */
+int ChaCha20Poly1305SealParallel(void* data, const uint64_t size,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, uint8_t tag[16], const int threads);
+int ChaCha20Poly1305OpenParallel(void* data, const uint64_t size,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, const uint8_t tag[16], const int threads);
+
+/* Seal or open count independent messages, each with its own key and nonce,
+ * as ChaCha20Poly1305Seal() and ChaCha20Poly1305Open() would one at a time.
+ * The status of each job is set to what those return. SealBatch writes the
+ * tag of a job, OpenBatch checks it and only decrypts messages whose tag
+ * matches, the data of the others is left as it was. Short messages are
+ * encrypted and authenticated several at a time, see ChaCha20Manager and
+ * Poly1305Batch(). */
+typedef struct ChaCha20Poly1305Job {
+    void*       data;
+    uint64_t    size;
+    const void* aad;
+    uint64_t    aad_size;
+    const void* key;
+    const void* nonce;
+    uint8_t     tag[16];
+    int         status;
+} ChaCha20Poly1305Job;
+
+void ChaCha20Poly1305SealBatch(ChaCha20Poly1305Job* jobs,
+        const uint64_t count);
+void ChaCha20Poly1305OpenBatch(ChaCha20Poly1305Job* jobs,
+        const uint64_t count);
+
+/* Vectored versions of ChaCha20Encrypt() and the AEAD for messages held in
+ * several buffers, e.g. header, payload fragments and trailer. The segments
+ * of the iovec list (from <sys/uio.h>) are encrypted as one contiguous
+ * message would be, so the result is the same as for the concatenation of
+ * the segments. They return -1 in the same cases as the functions they
+ * extend. Not available with CHACHA20_NO_IOVEC. */
+struct iovec;
+
+int ChaCha20EncryptIOV(const ChaCha20Context* ctx, const struct iovec* iov,
+        const int iovcnt);
+int ChaCha20Poly1305SealIOV(const struct iovec* iov, const int iovcnt,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, uint8_t tag[16]);
+int ChaCha20Poly1305OpenIOV(const struct iovec* iov, const int iovcnt,
+        const void* aad, const uint64_t aad_size, const void* key,
+        const void* nonce, const uint8_t tag[16]);
+
+#define ChaCha20DecryptIOV(c, v, n) ChaCha20EncryptIOV(c, v, n)
+
+/* XChaCha20 (draft-irtf-cfrg-xchacha) takes a 24 byte nonce, long enough to
+ * be picked at random for every message. HChaCha20() derives the 32 byte
+ * subkey for the first 16 nonce bytes, HChaCha20Batch() does the same for
+ * count nonces of 16 bytes each, several at a time with the SIMD kernels.
+ * XChaCha20Init() sets up a context for the subkey and the rest of the
+ * nonce, after which all the ChaCha20 functions apply. The AEAD functions
+ * behave like their ChaCha20Poly1305 counterparts. */
+void HChaCha20(uint8_t subkey[32], const void* key, const void* nonce);
+void HChaCha20Batch(uint8_t* subkeys, const void* key, const void* nonces,
+        const uint64_t count);
+void XChaCha20Init(ChaCha20Context* ctx, const void* key, const void* nonce);
+int XChaCha20Encrypt(void* data, const uint64_t size, const void* key,
+        const void* nonce);
+
+#define XChaCha20Decrypt(d, s, k, n) XChaCha20Encrypt(d, s, k, n)
+
+int XChaCha20Poly1305Seal(void* data, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        uint8_t tag[16]);
+int XChaCha20Poly1305Open(void* data, const uint64_t size, const void* aad,
+        const uint64_t aad_size, const void* key, const void* nonce,
+        const uint8_t tag[16]);
+
 // Uncomment if your system does not provide memcpy
 // #define MEMCPY_IMPL_NEEDED 
+
+// Uncomment if your system does not provide POSIX threads, the parallel
+// functions then do all the work on the calling thread
+// #define CHACHA20_NO_THREADS
+
+// Uncomment if your system does not provide struct iovec in <sys/uio.h>, the
+// vectored functions are then left out
+// #define CHACHA20_NO_IOVEC
+
+// Size from which ChaCha20EncryptTo() uses non-temporal stores, 0 means the
+// size of the last level cache of the host
+#ifndef CHACHA20_NT_MIN
+#define CHACHA20_NT_MIN 0
+#endif
+
+// Minimum bytes per thread and maximum threads for the parallel functions
+#ifndef CHACHA20_PARALLEL_MIN
+#define CHACHA20_PARALLEL_MIN (1 << 20)
+#endif
+
+#ifndef CHACHA20_MAX_THREADS
+#define CHACHA20_MAX_THREADS 256
+#endif
 #endif
@@ -2,12 +2,1085 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#ifndef CHACHA20_NO_IOVEC
+#include <sys/uio.h>
+#endif
+#if defined(__linux__) && !defined(CHACHA20_NO_THREADS)
+#include <dirent.h>
+#endif
 
 // Copyright(C) 2025 Shivashish Das. Licensed under the MIT License
 
+/* All kernels of the library. FOR_EACH_KERNEL(name) runs the statement that
+ * follows once for each of them the CPU supports, with that kernel active
+ * and its name in name. continue moves on to the next kernel. The callers
+ * put the kernel that was active before back themselves. */
+static const char* const kernel_names[] = { "scalar", "sse2", "ssse3",
+    "avx2", "avx512" };
+
+#define FOR_EACH_KERNEL(name) \
+    for (int kernel_ = 0; kernel_ < (int)(sizeof(kernel_names) / \
+                sizeof(kernel_names[0])); kernel_++) \
+        for (const char* name = kernel_names[kernel_]; name != NULL && \
+                ChaCha20SetKernel(name) == 0; name = NULL)
+
 // ChaCha20 test vector from RFC 7539
 const char* str = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+static int CheckTag(const char* what, const uint8_t* tag,
+        const uint8_t* expected) {
+    if (memcmp(tag, expected, 16) != 0) {
+        printf("Poly1305 tag mismatch: %s\n", what);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Poly1305 test vectors from RFC 8439 sections 2.5.2, 2.6.2 and A.3
+static int TestPoly1305(void) {
+    uint8_t tag[16];
+    const char* msg = "Cryptographic Forum Research Group";
+    uint8_t key[] = { 0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f,
+        0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8, 0x01, 0x03, 0x80, 0x8a, 0xfb,
+        0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b };
+    uint8_t expected[] = { 0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+        0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9 };
+    Poly1305(tag, msg, strlen(msg), key);
+    if (CheckTag("RFC 8439 2.5.2", tag, expected))
+        return 1;
+
+    // Same message fed in pieces of every size
+    const size_t len = strlen(msg);
+    for (size_t piece = 1; piece <= 17; piece++) {
+        Poly1305Context ctx;
+        Poly1305Init(&ctx, key);
+        for (size_t i = 0; i < len; i += piece) {
+            size_t n = (len - i < piece) ? len - i : piece;
+            Poly1305Update(&ctx, msg + i, n);
+        }
+
+        Poly1305Final(&ctx, tag);
+        if (CheckTag("RFC 8439 2.5.2 in pieces", tag, expected))
+            return 1;
+    }
+
+    // Poly1305MAC() must use the key generated as in 2.6.2
+    uint8_t cc_key[32], nonce[] = { 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7 };
+    for (int i = 0; i < 32; i++)
+        cc_key[i] = 0x80 + i;
+    uint8_t otk[] = { 0x8a, 0xd5, 0xa0, 0x8b, 0x90, 0x5f, 0x81, 0xcc, 0x81,
+        0x50, 0x40, 0x27, 0x4a, 0xb2, 0x94, 0x71, 0xa8, 0x33, 0xb6, 0x37, 0xe3,
+        0xfd, 0x0d, 0xa5, 0x08, 0xdb, 0xb8, 0xe2, 0xfd, 0xd1, 0xa6, 0x46 };
+    Poly1305(expected, msg, strlen(msg), otk);
+    Poly1305MAC(tag, msg, strlen(msg), cc_key, nonce);
+    if (CheckTag("RFC 8439 2.6.2 key generation", tag, expected))
+        return 1;
+
+    // A.3 #5 - #9, these check the corner cases of the final reduction
+    uint8_t r1[32] = { 1 }, r2[32] = { 2 }, r2s[32] = { 2 }, m[48];
+    memset(r2s + 16, 0xff, 16);
+    uint8_t t3[16] = { 3 }, t5[16] = { 5 }, t0[16] = { 0 }, tfa[16];
+    memset(tfa, 0xff, 16);
+    tfa[0] = 0xfa;
+
+    memset(m, 0xff, 16);
+    Poly1305(tag, m, 16, r2);
+    if (CheckTag("RFC 8439 A.3 #5", tag, t3))
+        return 1;
+
+    memset(m, 0, 16);
+    m[0] = 2;
+    Poly1305(tag, m, 16, r2s);
+    if (CheckTag("RFC 8439 A.3 #6", tag, t3))
+        return 1;
+
+    memset(m, 0xff, 32);
+    memset(m + 32, 0, 16);
+    m[16] = 0xf0;
+    m[32] = 0x11;
+    Poly1305(tag, m, 48, r1);
+    if (CheckTag("RFC 8439 A.3 #7", tag, t5))
+        return 1;
+
+    memset(m, 0xff, 16);
+    memset(m + 16, 0xfe, 16);
+    memset(m + 32, 0x01, 16);
+    m[16] = 0xfb;
+    Poly1305(tag, m, 48, r1);
+    if (CheckTag("RFC 8439 A.3 #8", tag, t0))
+        return 1;
+
+    memset(m, 0xff, 16);
+    m[0] = 0xfd;
+    Poly1305(tag, m, 16, r2);
+    if (CheckTag("RFC 8439 A.3 #9", tag, tfa))
+        return 1;
+
+    // Long messages take the SIMD code, which must agree with the scalar
+    // code for every length and split. All 0xff data and key maximise the
+    // limbs, the second pass uses less regular data.
+    const uint32_t big = 4096 + 7;
+    uint8_t* data = malloc(big);
+    uint8_t long_key[32];
+    const char* best = ChaCha20KernelName();
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < big; i++)
+            data[i] = pass == 0 ? 0xff : (uint8_t)(i * 131 + (i >> 8));
+        for (int i = 0; i < 32; i++)
+            long_key[i] = pass == 0 ? 0xff : (uint8_t)(i * 7 + 3);
+
+        for (uint32_t n = 0; n <= big; n += 93) {
+            ChaCha20SetKernel("scalar");
+            Poly1305(expected, data, n, long_key);
+            ChaCha20SetKernel(best);
+            Poly1305(tag, data, n, long_key);
+            if (CheckTag("long message against the scalar code", tag,
+                        expected))
+                return 1;
+
+            Poly1305Context ctx;
+            Poly1305Init(&ctx, long_key);
+            Poly1305Update(&ctx, data, n / 3);
+            Poly1305Update(&ctx, data + n / 3, n - n / 3);
+            Poly1305Final(&ctx, tag);
+            if (CheckTag("long message in two pieces", tag, expected))
+                return 1;
+        }
+    }
+
+    free(data);
+    printf("Poly1305 passed all tests.\n");
+    return 0;
+}
+
+// AEAD test vector from RFC 8439 section 2.8.2
+static int TestAEAD(void) {
+    uint32_t len = strlen(str);
+    uint8_t* data = malloc(len);
+    memcpy(data, str, len);
+
+    uint8_t key[32], tag[16];
+    for (int i = 0; i < 32; i++)
+        key[i] = 0x80 + i;
+    uint8_t nonce[] = { 0x07, 0, 0, 0, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45,
+        0x46, 0x47 };
+    uint8_t aad[] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4,
+        0xc5, 0xc6, 0xc7 };
+    uint8_t expected_tag[] = { 0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2,
+        0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91 };
+    uint8_t ciphertext[] = { 0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb,
+        0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2, 0xa4, 0xad, 0xed, 0x51,
+        0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+        0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69,
+        0xda, 0x92, 0x72, 0x8b, 0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29,
+        0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36, 0x92, 0xdd, 0xbd, 0x7f,
+        0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+        0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b,
+        0x48, 0x31, 0xd7, 0xbc, 0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d,
+        0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b, 0x61, 0x16 };
+
+    ChaCha20Poly1305Seal(data, len, aad, sizeof(aad), key, nonce, tag);
+    if (memcmp(data, ciphertext, len) != 0 ||
+            memcmp(tag, expected_tag, 16) != 0) {
+        printf("AEAD ciphertext or tag does not match test vector\n");
+        return 1;
+    }
+
+    // A modified tag or ciphertext must be rejected and the ciphertext must
+    // be left in data
+    tag[15] ^= 1;
+    if (ChaCha20Poly1305Open(data, len, aad, sizeof(aad), key, nonce, tag)
+            != -1 || memcmp(data, ciphertext, len) != 0) {
+        printf("AEAD open accepted a modified tag\n");
+        return 1;
+    }
+
+    tag[15] ^= 1;
+    data[len - 1] ^= 0x80;
+    if (ChaCha20Poly1305Open(data, len, aad, sizeof(aad), key, nonce, tag)
+            != -1 || memcmp(data, ciphertext, len - 1) != 0) {
+        printf("AEAD open accepted a modified ciphertext\n");
+        return 1;
+    }
+
+    data[len - 1] ^= 0x80;
+    if (ChaCha20Poly1305Open(data, len, aad, sizeof(aad), key, nonce, tag)
+            != 0 || memcmp(data, str, len) != 0) {
+        printf("AEAD round trip has failed\n");
+        return 1;
+    }
+
+    // Messages spanning several tiles must round trip, and the tag must be
+    // the same as for Poly1305 run over the whole ciphertext
+    const uint32_t big = 3 * 16384 + 100;
+    uint8_t* msg = malloc(big);
+    for (uint32_t i = 0; i < big; i++)
+        msg[i] = (uint8_t)i;
+    ChaCha20Poly1305Seal(msg, big, aad, sizeof(aad), key, nonce, tag);
+
+    uint8_t otk[32] = { 0 }, pad[16] = { 0 }, lengths[16] = { 0 }, mac[16];
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    ChaCha20SetCounter(&ctx, 0);
+    ChaCha20Encrypt(&ctx, otk, 32);
+    lengths[0] = sizeof(aad);
+    memcpy(lengths + 8, &big, sizeof(big));
+
+    Poly1305Context poly;
+    Poly1305Init(&poly, otk);
+    Poly1305Update(&poly, aad, sizeof(aad));
+    Poly1305Update(&poly, pad, 16 - sizeof(aad) % 16);
+    Poly1305Update(&poly, msg, big);
+    Poly1305Update(&poly, pad, 16 - big % 16);
+    Poly1305Update(&poly, lengths, 16);
+    Poly1305Final(&poly, mac);
+    if (memcmp(mac, tag, 16) != 0) {
+        printf("AEAD tag of a long message is wrong\n");
+        return 1;
+    }
+
+    if (ChaCha20Poly1305Open(msg, big, aad, sizeof(aad), key, nonce, tag)
+            != 0) {
+        printf("AEAD open rejected a long message\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < big; i++) {
+        if (msg[i] != (uint8_t)i) {
+            printf("AEAD round trip of a long message has failed\n");
+            return 1;
+        }
+    }
+
+    // Short messages can be sealed with a single kernel call, which must not
+    // change the result on any kernel or length
+    const char* best = ChaCha20KernelName();
+    uint8_t reference[1100], sealed[1100], ref_tag[16];
+    for (uint32_t n = 0; n < sizeof(reference); n += 7) {
+        ChaCha20SetKernel("scalar");
+        memcpy(reference, msg, n);
+        ChaCha20Poly1305Seal(reference, n, aad, sizeof(aad), key, nonce,
+                ref_tag);
+
+        FOR_EACH_KERNEL(name) {
+            if (strcmp(name, "scalar") == 0)
+                continue;
+
+            memcpy(sealed, msg, n);
+            ChaCha20Poly1305Seal(sealed, n, aad, sizeof(aad), key, nonce,
+                    tag);
+            if (memcmp(sealed, reference, n) != 0 ||
+                    memcmp(tag, ref_tag, 16) != 0) {
+                printf("AEAD seal of %u bytes differs from the scalar one "
+                        "(%s kernel)\n", n, name);
+                return 1;
+            }
+
+            if (ChaCha20Poly1305Open(sealed, n, aad, sizeof(aad), key, nonce,
+                        tag) != 0 || memcmp(sealed, msg, n) != 0) {
+                printf("AEAD round trip of %u bytes has failed (%s kernel)\n",
+                        n, name);
+                return 1;
+            }
+
+            tag[0] ^= 1;
+            memcpy(sealed, reference, n);
+            if (ChaCha20Poly1305Open(sealed, n, aad, sizeof(aad), key, nonce,
+                        tag) != -1 || memcmp(sealed, reference, n) != 0) {
+                printf("AEAD open of %u bytes accepted a modified tag (%s "
+                        "kernel)\n", n, name);
+                return 1;
+            }
+        }
+    }
+
+    ChaCha20SetKernel(best);
+    free(msg);
+    free(data);
+    printf("ChaCha20-Poly1305 passed all tests.\n");
+    return 0;
+}
+
+// HChaCha20 and XChaCha20-Poly1305 test vectors from draft-irtf-cfrg-xchacha
+static int TestXChaCha20(void) {
+    uint8_t key[32], nonce[24], subkey[32];
+    for (int i = 0; i < 32; i++)
+        key[i] = i;
+    uint8_t hnonce[] = { 0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0, 0x31, 0x41,
+        0x59, 0x27 };
+    uint8_t expected_subkey[] = { 0x82, 0x41, 0x3b, 0x42, 0x27, 0xb2, 0x7b,
+        0xfe, 0xd3, 0x0e, 0x42, 0x50, 0x8a, 0x87, 0x7d, 0x73, 0xa0, 0xf9,
+        0xe4, 0xd5, 0x8a, 0x74, 0xa8, 0x53, 0xc1, 0x2e, 0xc4, 0x13, 0x26,
+        0xd3, 0xec, 0xdc };
+    HChaCha20(subkey, key, hnonce);
+    if (memcmp(subkey, expected_subkey, 32) != 0) {
+        printf("HChaCha20 subkey does not match test vector\n");
+        return 1;
+    }
+
+    // The batch version must agree with HChaCha20() on every kernel, for
+    // full and partial batches
+    const char* best = ChaCha20KernelName();
+    uint8_t nonces[40 * 16], subkeys[41 * 32];
+    for (size_t i = 0; i < sizeof(nonces); i++)
+        nonces[i] = (uint8_t)(i * 7 + 3);
+    FOR_EACH_KERNEL(name) {
+        for (int count = 0; count <= 40; count++) {
+            memset(subkeys, 0xee, sizeof(subkeys));
+            HChaCha20Batch(subkeys, key, nonces, count);
+            for (int j = 0; j < count; j++) {
+                HChaCha20(subkey, key, nonces + 16 * j);
+                if (memcmp(subkeys + 32 * j, subkey, 32) != 0) {
+                    printf("HChaCha20Batch of %d nonces differs at %d (%s "
+                            "kernel)\n", count, j, name);
+                    return 1;
+                }
+            }
+
+            if (subkeys[32 * count] != 0xee) {
+                printf("HChaCha20Batch of %d nonces wrote past the end (%s "
+                        "kernel)\n", count, name);
+                return 1;
+            }
+        }
+    }
+    ChaCha20SetKernel(best);
+
+    uint32_t len = strlen(str);
+    uint8_t* data = malloc(len);
+    uint8_t tag[16];
+    for (int i = 0; i < 32; i++)
+        key[i] = 0x80 + i;
+    for (int i = 0; i < 24; i++)
+        nonce[i] = 0x40 + i;
+    uint8_t aad[] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4,
+        0xc5, 0xc6, 0xc7 };
+    uint8_t expected_tag[] = { 0xc0, 0x87, 0x59, 0x24, 0xc1, 0xc7, 0x98,
+        0x79, 0x47, 0xde, 0xaf, 0xd8, 0x78, 0x0a, 0xcf, 0x49 };
+    uint8_t ciphertext[] = { 0xbd, 0x6d, 0x17, 0x9d, 0x3e, 0x83, 0xd4, 0x3b,
+        0x95, 0x76, 0x57, 0x94, 0x93, 0xc0, 0xe9, 0x39, 0x57, 0x2a, 0x17, 0x00,
+        0x25, 0x2b, 0xfa, 0xcc, 0xbe, 0xd2, 0x90, 0x2c, 0x21, 0x39, 0x6c, 0xbb,
+        0x73, 0x1c, 0x7f, 0x1b, 0x0b, 0x4a, 0xa6, 0x44, 0x0b, 0xf3, 0xa8, 0x2f,
+        0x4e, 0xda, 0x7e, 0x39, 0xae, 0x64, 0xc6, 0x70, 0x8c, 0x54, 0xc2, 0x16,
+        0xcb, 0x96, 0xb7, 0x2e, 0x12, 0x13, 0xb4, 0x52, 0x2f, 0x8c, 0x9b, 0xa4,
+        0x0d, 0xb5, 0xd9, 0x45, 0xb1, 0x1b, 0x69, 0xb9, 0x82, 0xc1, 0xbb, 0x9e,
+        0x3f, 0x3f, 0xac, 0x2b, 0xc3, 0x69, 0x48, 0x8f, 0x76, 0xb2, 0x38, 0x35,
+        0x65, 0xd3, 0xff, 0xf9, 0x21, 0xf9, 0x66, 0x4c, 0x97, 0x63, 0x7d, 0xa9,
+        0x76, 0x88, 0x12, 0xf6, 0x15, 0xc6, 0x8b, 0x13, 0xb5, 0x2e };
+
+    memcpy(data, str, len);
+    XChaCha20Poly1305Seal(data, len, aad, sizeof(aad), key, nonce, tag);
+    if (memcmp(data, ciphertext, len) != 0 ||
+            memcmp(tag, expected_tag, 16) != 0) {
+        printf("XChaCha20-Poly1305 ciphertext or tag does not match test "
+                "vector\n");
+        return 1;
+    }
+
+    tag[0] ^= 1;
+    if (XChaCha20Poly1305Open(data, len, aad, sizeof(aad), key, nonce, tag)
+            != -1 || memcmp(data, ciphertext, len) != 0) {
+        printf("XChaCha20-Poly1305 open accepted a modified tag\n");
+        return 1;
+    }
+
+    tag[0] ^= 1;
+    if (XChaCha20Poly1305Open(data, len, aad, sizeof(aad), key, nonce, tag)
+            != 0 || memcmp(data, str, len) != 0) {
+        printf("XChaCha20-Poly1305 round trip has failed\n");
+        return 1;
+    }
+
+    // The AEAD encrypts from block 1 like XChaCha20Encrypt()
+    XChaCha20Encrypt(data, len, key, nonce);
+    if (memcmp(data, ciphertext, len) != 0) {
+        printf("XChaCha20 ciphertext does not match the AEAD one\n");
+        return 1;
+    }
+
+    free(data);
+    printf("XChaCha20 passed all tests.\n");
+    return 0;
+}
+
+#if defined(__linux__) && !defined(CHACHA20_NO_THREADS)
+/* Number of threads of the process that have been running for more than 2 ms
+ * altogether, or -1 if /proc does not tell. */
+static int BusyThreads(void) {
+    DIR* dir = opendir("/proc/self/task");
+    if (dir == NULL)
+        return -1;
+    int busy = 0;
+    struct dirent* entry;
+    while (busy >= 0 && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        char path[300];
+        unsigned long long ns = 0;
+        snprintf(path, sizeof(path), "/proc/self/task/%s/schedstat",
+                entry->d_name);
+        FILE* file = fopen(path, "r");
+        if (file == NULL || fscanf(file, "%llu", &ns) != 1)
+            busy = -1;
+        else if (ns > 2000000)
+            busy++;
+        if (file != NULL)
+            fclose(file);
+    }
+    closedir(dir);
+    return busy;
+}
+
+/* The worker threads started by the first parallel call have to help with
+ * that call already and not only with the next one. Must run before anything
+ * else uses the thread pool. */
+static int TestThreadPool(void) {
+    uint8_t key[32] = { 1 }, nonce[12] = { 2 };
+    const uint64_t size = 64ULL * CHACHA20_PARALLEL_MIN;
+    uint8_t* data = calloc(size, 1);
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    if (ChaCha20EncryptParallel(&ctx, data, size, 4) != 0) {
+        printf("ChaCha20EncryptParallel() of %llu bytes failed\n",
+                (unsigned long long)size);
+        return 1;
+    }
+    free(data);
+
+    int busy = BusyThreads();
+    if (busy < 0) {
+        printf("No per thread run times in /proc, thread pool not tested\n");
+        return 0;
+    }
+    if (busy < 2) {
+        printf("Only the calling thread worked on the first "
+                "ChaCha20EncryptParallel()\n");
+        return 1;
+    }
+    printf("Thread pool passed all tests.\n");
+    return 0;
+}
+#endif
+
+/* The 64-bit counter of ChaCha20InitDJB() continues into word 13, so around
+ * 2^32 blocks its keystream must be the RFC one with the high counter word
+ * as the first nonce word. Counters must never wrap. */
+static int TestCounter64(void) {
+    uint8_t key[32], nonce8[8], nonce12[12] = { 0 };
+    for (int i = 0; i < 32; i++)
+        key[i] = 0x40 + i;
+    for (int i = 0; i < 8; i++)
+        nonce8[i] = 0xa0 + i;
+    memcpy(nonce12 + 4, nonce8, 8);
+
+    // 5 blocks before word 12 wraps and 40 after it
+    const uint32_t size = 45 * 64 + 17;
+    uint8_t expected[45 * 64 + 17] = { 0 }, tmp[45 * 64 + 17];
+    ChaCha20Context ietf, djb;
+    ChaCha20Init(&ietf, key, nonce12);
+    ChaCha20SetCounter(&ietf, 0xfffffffb);
+    ChaCha20Encrypt(&ietf, expected, 5 * 64);
+    nonce12[0] = 1;
+    ChaCha20Init(&ietf, key, nonce12);
+    ChaCha20SetCounter(&ietf, 0);
+    ChaCha20Encrypt(&ietf, expected + 5 * 64, size - 5 * 64);
+
+    ChaCha20InitDJB(&djb, key, nonce8);
+    ChaCha20SetCounter64(&djb, 0xfffffffbULL);
+    const char* best = ChaCha20KernelName();
+    FOR_EACH_KERNEL(name) {
+        for (uint32_t off = 0; off < size; off += 53) {
+            for (uint32_t n = 0; off + n <= size; n += 331) {
+                memset(tmp, 0, n);
+                if (ChaCha20EncryptAt(&djb, tmp, n, off) != 0 ||
+                        memcmp(tmp, expected + off, n) != 0) {
+                    printf("64-bit counter keystream of %u bytes at offset %u "
+                            "is wrong (%s kernel)\n", n, off, name);
+                    return 1;
+                }
+            }
+        }
+    }
+    ChaCha20SetKernel(best);
+
+    // The parallel version with word 12 wrapping inside one of the chunks
+    const uint32_t huge = 3 * CHACHA20_PARALLEL_MIN + 17;
+    uint8_t* serial = calloc(huge, 1);
+    uint8_t* parallel = calloc(huge, 1);
+    ChaCha20SetCounter64(&djb, 0x1ffffffffULL - CHACHA20_PARALLEL_MIN / 64);
+    ChaCha20Encrypt(&djb, serial, huge);
+    for (int threads = 1; threads <= 4; threads++) {
+        memset(parallel, 0, huge);
+        if (ChaCha20EncryptParallel(&djb, parallel, huge, threads) != 0 ||
+                memcmp(parallel, serial, huge) != 0) {
+            printf("64-bit counter ChaCha20EncryptParallel() with %d threads "
+                    "does not match ChaCha20Encrypt()\n", threads);
+            return 1;
+        }
+    }
+
+    // The last block of either counter can be used, the one after it not
+    memset(tmp, 0, 65);
+    ChaCha20SetCounter(&ietf, 0xffffffff);
+    ChaCha20SetCounter64(&djb, ~0ULL);
+    if (ChaCha20Encrypt(&ietf, tmp, 64) != 0 ||
+            ChaCha20Encrypt(&djb, tmp, 64) != 0 ||
+            ChaCha20EncryptAt(&djb, tmp, 1, 63) != 0) {
+        printf("The last block of the counter is rejected\n");
+        return 1;
+    }
+
+    memcpy(expected, tmp, 65);
+    if (ChaCha20Encrypt(&ietf, tmp, 65) != -1 ||
+            ChaCha20Encrypt(&djb, tmp, 65) != -1 ||
+            ChaCha20EncryptAt(&djb, tmp, 1, 64) != -1 ||
+            ChaCha20EncryptParallel(&djb, parallel, huge, 2) != -1 ||
+            memcmp(tmp, expected, 65) != 0) {
+        printf("Counter wrap around was not reported\n");
+        return 1;
+    }
+
+    ChaCha20SetCounter(&ietf, 0);
+    if (ChaCha20EncryptAt(&ietf, tmp, 1, 0x4000000000ULL) != -1 ||
+            ChaCha20EncryptAt(&ietf, tmp, 2, ~0ULL) != -1 ||
+            ChaCha20SetCounter64(&ietf, 0x100000000ULL) != -1) {
+        printf("32-bit counter overflow was not reported\n");
+        return 1;
+    }
+
+    free(serial);
+    free(parallel);
+    printf("64-bit counter passed all tests.\n");
+    return 0;
+}
+
+/* ChaCha8 and ChaCha12 keystream for an all zero key and nonce (block 0),
+ * from draft-strombergson-chacha-test-vectors. Every kernel must agree with
+ * the scalar one for both round counts. */
+static int TestReducedRounds(void) {
+    uint8_t key[32] = { 0 }, nonce[8] = { 0 };
+    uint8_t expected[2][64] = { {
+        0x3e, 0x00, 0xef, 0x2f, 0x89, 0x5f, 0x40, 0xd6, 0x7f, 0x5b, 0xb8,
+        0xe8, 0x1f, 0x09, 0xa5, 0xa1, 0x2c, 0x84, 0x0e, 0xc3, 0xce, 0x9a,
+        0x7f, 0x3b, 0x18, 0x1b, 0xe1, 0x88, 0xef, 0x71, 0x1a, 0x1e, 0x98,
+        0x4c, 0xe1, 0x72, 0xb9, 0x21, 0x6f, 0x41, 0x9f, 0x44, 0x53, 0x67,
+        0x45, 0x6d, 0x56, 0x19, 0x31, 0x4a, 0x42, 0xa3, 0xda, 0x86, 0xb0,
+        0x01, 0x38, 0x7b, 0xfd, 0xb8, 0x0e, 0x0c, 0xfe, 0x42 }, {
+        0x9b, 0xf4, 0x9a, 0x6a, 0x07, 0x55, 0xf9, 0x53, 0x81, 0x1f, 0xce,
+        0x12, 0x5f, 0x26, 0x83, 0xd5, 0x04, 0x29, 0xc3, 0xbb, 0x49, 0xe0,
+        0x74, 0x14, 0x7e, 0x00, 0x89, 0xa5, 0x2e, 0xae, 0x15, 0x5f, 0x05,
+        0x64, 0xf8, 0x79, 0xd2, 0x7a, 0xe3, 0xc0, 0x2c, 0xe8, 0x28, 0x34,
+        0xac, 0xfa, 0x8c, 0x79, 0x3a, 0x62, 0x9f, 0x2c, 0xa0, 0xde, 0x69,
+        0x19, 0x61, 0x0b, 0xe8, 0x2f, 0x41, 0x13, 0x26, 0xbe } };
+    const int rounds[2] = { 8, 12 };
+    const char* best = ChaCha20KernelName();
+    const uint32_t big = 4096 + 37;
+    uint8_t* stream = malloc(big);
+    uint8_t* tmp = malloc(big);
+
+    ChaCha20Context ctx;
+    ChaCha20InitDJB(&ctx, key, nonce);
+    if (ChaCha20SetRounds(&ctx, 10) != -1) {
+        printf("ChaCha20SetRounds() accepted 10 rounds\n");
+        return 1;
+    }
+
+    for (int r = 0; r < 2; r++) {
+        ChaCha20SetRounds(&ctx, rounds[r]);
+        ChaCha20SetKernel("scalar");
+        memset(stream, 0, big);
+        ChaCha20Encrypt(&ctx, stream, big);
+        if (memcmp(stream, expected[r], 64) != 0) {
+            printf("ChaCha%d keystream does not match test vector\n",
+                    rounds[r]);
+            return 1;
+        }
+
+        FOR_EACH_KERNEL(name) {
+            if (strcmp(name, "scalar") == 0)
+                continue;
+
+            for (uint32_t n = 1; n <= big - 64; n += 61) {
+                memset(tmp, 0, n);
+                ChaCha20EncryptAt(&ctx, tmp, n, 64);
+                if (memcmp(tmp, stream + 64, n) != 0) {
+                    printf("ChaCha%d keystream of length %u differs from the "
+                            "scalar one (%s kernel)\n", rounds[r], n,
+                            name);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    ChaCha20SetKernel(best);
+    free(stream);
+    free(tmp);
+    printf("ChaCha8 and ChaCha12 passed all tests.\n");
+    return 0;
+}
+
+// Any split of a message into stream updates must give the one call result
+static int TestStream(void) {
+    uint8_t key[32], nonce[12] = { 0, 0, 0, 1 };
+    for (int i = 0; i < 32; i++)
+        key[i] = 3 * i;
+
+    const uint32_t size = 3 * 4096 + 29;
+    uint8_t* expected = calloc(size, 1);
+    uint8_t* tmp = malloc(size);
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    ChaCha20Encrypt(&ctx, expected, size);
+
+    // Piece sizes around the block size and the kernel widths
+    const uint32_t pieces[] = { 1, 7, 63, 64, 65, 100, 255, 256, 257, 511,
+        1024, 1500, 4096 };
+    for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+        ChaCha20Stream stream;
+        ChaCha20StreamInit(&stream, &ctx);
+        memset(tmp, 0, size);
+        for (uint32_t off = 0, i = 0; off < size; i++) {
+            // Alternate between the piece size and a few odd sizes
+            uint32_t n = (i % 2 == 0) ? pieces[p] : 1 + (i * 37) % 70;
+            if (n > size - off)
+                n = size - off;
+            ChaCha20StreamUpdate(&stream, tmp + off, n);
+            off += n;
+        }
+
+        ChaCha20StreamFinal(&stream);
+        if (memcmp(tmp, expected, size) != 0) {
+            printf("Stream with pieces of %u bytes does not match "
+                    "ChaCha20Encrypt()\n", pieces[p]);
+            return 1;
+        }
+    }
+
+    // Updates of 0 bytes change nothing
+    ChaCha20Stream stream;
+    ChaCha20StreamInit(&stream, &ctx);
+    memset(tmp, 0, size);
+    ChaCha20StreamUpdate(&stream, tmp, 10);
+    ChaCha20StreamUpdate(&stream, tmp + 10, 0);
+    ChaCha20StreamUpdate(&stream, tmp + 10, size - 10);
+    ChaCha20StreamFinal(&stream);
+    if (memcmp(tmp, expected, size) != 0) {
+        printf("Stream with an empty update does not match "
+                "ChaCha20Encrypt()\n");
+        return 1;
+    }
+
+    // A stream must stop at the end of the counter like ChaCha20Encrypt()
+    ChaCha20SetCounter(&ctx, 0xffffffff);
+    ChaCha20StreamInit(&stream, &ctx);
+    if (ChaCha20StreamUpdate(&stream, tmp, 60) != 0 ||
+            ChaCha20StreamUpdate(&stream, tmp, 4) != 0 ||
+            ChaCha20StreamUpdate(&stream, tmp, 1) != -1) {
+        printf("Stream did not stop at the end of the counter\n");
+        return 1;
+    }
+
+    free(expected);
+    free(tmp);
+    printf("ChaCha20 streams passed all tests.\n");
+    return 0;
+}
+
+#ifndef CHACHA20_NO_IOVEC
+/* Messages split into iovec segments, including empty ones, must give the
+ * same result as the contiguous message */
+static int TestIOV(void) {
+    uint8_t key[32], nonce[12] = { 9 }, aad[5] = { 1, 2, 3, 4, 5 };
+    for (int i = 0; i < 32; i++)
+        key[i] = 0x11 * i;
+
+    const uint32_t size = 40000;
+    uint8_t* msg = malloc(size);
+    uint8_t* expected = malloc(size);
+    uint8_t* tmp = malloc(size);
+    for (uint32_t i = 0; i < size; i++)
+        msg[i] = (uint8_t)(i * 13);
+
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    const uint32_t lengths[] = { 0, 1, 63, 300, 2049, 20000 };
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        // Segment sizes cycle through 0 .. 150, then the rest in one piece
+        struct iovec iov[64];
+        int iovcnt = 0;
+        uint32_t len = lengths[l], off = 0;
+        while (off < len && iovcnt < 63) {
+            uint32_t n = (iovcnt * 47) % 151;
+            if (n > len - off)
+                n = len - off;
+            iov[iovcnt].iov_base = tmp + off;
+            iov[iovcnt++].iov_len = n;
+            off += n;
+        }
+        iov[iovcnt].iov_base = tmp + off;
+        iov[iovcnt++].iov_len = len - off;
+
+        uint8_t tag[16], expected_tag[16];
+        memcpy(expected, msg, len);
+        ChaCha20Encrypt(&ctx, expected, len);
+        memcpy(tmp, msg, len);
+        if (ChaCha20EncryptIOV(&ctx, iov, iovcnt) != 0 ||
+                memcmp(tmp, expected, len) != 0) {
+            printf("ChaCha20EncryptIOV() of %u bytes does not match "
+                    "ChaCha20Encrypt()\n", len);
+            return 1;
+        }
+
+        memcpy(expected, msg, len);
+        ChaCha20Poly1305Seal(expected, len, aad, sizeof(aad), key, nonce,
+                expected_tag);
+        memcpy(tmp, msg, len);
+        if (ChaCha20Poly1305SealIOV(iov, iovcnt, aad, sizeof(aad), key, nonce,
+                    tag) != 0 || memcmp(tmp, expected, len) != 0 ||
+                memcmp(tag, expected_tag, 16) != 0) {
+            printf("ChaCha20Poly1305SealIOV() of %u bytes does not match "
+                    "ChaCha20Poly1305Seal()\n", len);
+            return 1;
+        }
+
+        tag[3] ^= 4;
+        if (ChaCha20Poly1305OpenIOV(iov, iovcnt, aad, sizeof(aad), key, nonce,
+                    tag) != -1 || memcmp(tmp, expected, len) != 0) {
+            printf("ChaCha20Poly1305OpenIOV() of %u bytes accepted a "
+                    "modified tag\n", len);
+            return 1;
+        }
+
+        tag[3] ^= 4;
+        if (ChaCha20Poly1305OpenIOV(iov, iovcnt, aad, sizeof(aad), key, nonce,
+                    tag) != 0 || memcmp(tmp, msg, len) != 0) {
+            printf("ChaCha20Poly1305OpenIOV() round trip of %u bytes has "
+                    "failed\n", len);
+            return 1;
+        }
+    }
+
+    free(msg);
+    free(expected);
+    free(tmp);
+    printf("iovec functions passed all tests.\n");
+    return 0;
+}
+#endif
+
+/* Out-of-place encryption must match in-place encryption for any alignment
+ * of dst. Building with a small CHACHA20_NT_MIN also covers the non-temporal
+ * path. */
+static int TestEncryptTo(void) {
+    uint8_t key[32], nonce[12] = { 1, 2, 3 };
+    for (int i = 0; i < 32; i++)
+        key[i] = 0xf0 - i;
+
+    uint32_t sizes[] = { 0, 1, 100, 4133, 3 * 8192 + 77, 0, 0 };
+#if CHACHA20_NT_MIN > 0 && CHACHA20_NT_MIN < (16 << 20)
+    sizes[5] = CHACHA20_NT_MIN;
+    sizes[6] = CHACHA20_NT_MIN + 2 * 8192 + 5;
+#endif
+    const uint32_t max = 16 << 20;
+    uint8_t* src = malloc(max);
+    uint8_t* expected = malloc(max);
+    uint8_t* dst = malloc(max + 64);
+    for (uint32_t i = 0; i < max; i++)
+        src[i] = (uint8_t)(i ^ (i >> 9));
+
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, nonce);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t n = sizes[i];
+        memcpy(expected, src, n);
+        ChaCha20Encrypt(&ctx, expected, n);
+
+        for (int align = 0; align < 64; align += 7) {
+            memset(dst, 0xee, n + 64);
+            if (ChaCha20EncryptTo(&ctx, dst + align, src, n) != 0 ||
+                    memcmp(dst + align, expected, n) != 0 ||
+                    (align > 0 && dst[align - 1] != 0xee) ||
+                    dst[align + n] != 0xee) {
+                printf("ChaCha20EncryptTo() of %u bytes at alignment %d does "
+                        "not match ChaCha20Encrypt()\n", n, align);
+                return 1;
+            }
+        }
+    }
+
+    free(src);
+    free(expected);
+    free(dst);
+    printf("Out-of-place encryption passed all tests.\n");
+    return 0;
+}
+
+/* Jobs with their own keys and sizes, including an empty one, one whose
+ * 64-bit counter carries into word 13 and one the manager must reject, must
+ * each come back exactly once and match ChaCha20Encrypt() with every
+ * kernel. */
+static int TestMultiBuffer(void) {
+    enum { JOBS = 41 };
+    const char* best = ChaCha20KernelName();
+    ChaCha20Context ctx[JOBS];
+    ChaCha20Job jobs[JOBS];
+    uint8_t* data[JOBS];
+    uint8_t* expected[JOBS];
+    int returned[JOBS];
+
+    for (int i = 0; i < JOBS; i++) {
+        uint8_t key[32], nonce[12] = { 0, 0, 0, 0, (uint8_t)i };
+        for (int j = 0; j < 32; j++)
+            key[j] = (uint8_t)(i * 7 + j);
+
+        if (i == 3) {
+            ChaCha20InitDJB(&ctx[i], key, nonce);
+            ChaCha20SetCounter64(&ctx[i], 0xfffffffeULL);
+        } else {
+            ChaCha20Init(&ctx[i], key, nonce);
+        }
+        if (i == 5)
+            ChaCha20SetRounds(&ctx[i], 12);
+
+        uint64_t size = (i == 7) ? 0 : (i * 97) % 600 + 1;
+        data[i] = malloc(size + 1);
+        expected[i] = malloc(size + 1);
+        for (uint64_t j = 0; j < size; j++)
+            expected[i][j] = (uint8_t)(i + j);
+        if (i != 5)
+            ChaCha20Encrypt(&ctx[i], expected[i], size);
+        jobs[i].size = size;
+    }
+
+    FOR_EACH_KERNEL(name) {
+        ChaCha20Manager mgr;
+        ChaCha20ManagerInit(&mgr);
+        ChaCha20Job* job;
+        int count = 0;
+        for (int i = 0; i < JOBS; i++) {
+            for (uint64_t j = 0; j < jobs[i].size; j++)
+                data[i][j] = (uint8_t)(i + j);
+            jobs[i].ctx = &ctx[i];
+            jobs[i].data = data[i];
+            jobs[i].status = 1;
+            jobs[i].user_data = &returned[i];
+            returned[i] = 0;
+        }
+
+        for (int i = 0; i < JOBS; i++) {
+            if ((job = ChaCha20ManagerSubmit(&mgr, &jobs[i])) != NULL) {
+                (*(int*)job->user_data)++;
+                count++;
+            }
+        }
+        while ((job = ChaCha20ManagerFlush(&mgr)) != NULL) {
+            (*(int*)job->user_data)++;
+            count++;
+        }
+
+        for (int i = 0; i < JOBS; i++) {
+            if (count != JOBS || returned[i] != 1) {
+                printf("Multi-buffer job %d was returned %d times (%s "
+                        "kernel)\n", i, returned[i], name);
+                return 1;
+            }
+            if (jobs[i].status != ((i == 5) ? -1 : 0) ||
+                    memcmp(data[i], expected[i], jobs[i].size) != 0) {
+                printf("Multi-buffer job %d does not match ChaCha20Encrypt() "
+                        "(%s kernel)\n", i, name);
+                return 1;
+            }
+        }
+    }
+
+    ChaCha20SetKernel(best);
+    for (int i = 0; i < JOBS; i++) {
+        free(data[i]);
+        free(expected[i]);
+    }
+    printf("Multi-buffer manager passed all tests.\n");
+    return 0;
+}
+
+/* Batches of messages of mixed sizes, a few of them long enough to be
+ * handed over to the single message code, must give the same tags and
+ * ciphertexts as one call per message with every kernel. */
+static int TestBatch(void) {
+    enum { COUNT = 29 };
+    const char* best = ChaCha20KernelName();
+    uint8_t keys[32 * COUNT], nonces[12 * COUNT], aad[COUNT][20];
+    uint8_t tags[16 * COUNT], check[16];
+    uint8_t* msgs[COUNT];
+    uint8_t* plain[COUNT];
+    uint64_t sizes[COUNT];
+    ChaCha20Poly1305Job jobs[COUNT];
+
+    for (int i = 0; i < COUNT; i++) {
+        sizes[i] = (i % 10 == 9) ? 3000 + i : (i * 53) % 300;
+        msgs[i] = malloc(sizes[i] + 1);
+        plain[i] = malloc(sizes[i] + 1);
+        for (uint64_t j = 0; j < sizes[i]; j++)
+            plain[i][j] = (uint8_t)(i * 3 + j);
+        for (int j = 0; j < 32; j++)
+            keys[32 * i + j] = (uint8_t)(i + 11 * j);
+        for (int j = 0; j < 12; j++)
+            nonces[12 * i + j] = (uint8_t)(i ^ j);
+        for (int j = 0; j < 20; j++)
+            aad[i][j] = (uint8_t)(i - j);
+    }
+
+    FOR_EACH_KERNEL(name) {
+        for (int count = 0; count <= COUNT; count += 7) {
+            for (int i = 0; i < count; i++)
+                memcpy(msgs[i], plain[i], sizes[i]);
+            Poly1305Batch(tags, (const void* const*)msgs, sizes, keys, count);
+            for (int i = 0; i < count; i++) {
+                Poly1305(check, msgs[i], sizes[i], keys + 32 * i);
+                if (memcmp(check, tags + 16 * i, 16) != 0) {
+                    printf("Poly1305Batch() tag %d of %d does not match "
+                            "Poly1305() (%s kernel)\n", i, count, name);
+                    return 1;
+                }
+            }
+        }
+
+        for (int i = 0; i < COUNT; i++) {
+            memcpy(msgs[i], plain[i], sizes[i]);
+            jobs[i].data = msgs[i];
+            jobs[i].size = sizes[i];
+            jobs[i].aad = aad[i];
+            jobs[i].aad_size = (i % 3 == 0) ? 0 : 4 + i % 17;
+            jobs[i].key = keys + 32 * i;
+            jobs[i].nonce = nonces + 12 * i;
+        }
+        jobs[4].size = (1ULL << 38) - 63;
+        ChaCha20Poly1305SealBatch(jobs, COUNT);
+
+        for (int i = 0; i < COUNT; i++) {
+            uint8_t* copy = malloc(sizes[i] + 1);
+            memcpy(copy, plain[i], sizes[i]);
+            int ret = ChaCha20Poly1305Seal(copy, jobs[i].size, jobs[i].aad,
+                    jobs[i].aad_size, jobs[i].key, jobs[i].nonce, check);
+            if (jobs[i].status != ret || (ret == 0 &&
+                        (memcmp(check, jobs[i].tag, 16) != 0 ||
+                         memcmp(copy, msgs[i], sizes[i]) != 0))) {
+                printf("ChaCha20Poly1305SealBatch() job %d does not match "
+                        "ChaCha20Poly1305Seal() (%s kernel)\n", i, name);
+                return 1;
+            }
+            free(copy);
+        }
+
+        // A forged message must stay as it was and not stop the others
+        jobs[4].size = sizes[4];
+        ChaCha20Poly1305Seal(msgs[4], sizes[4], jobs[4].aad,
+                jobs[4].aad_size, jobs[4].key, jobs[4].nonce, jobs[4].tag);
+        jobs[7].tag[5] ^= 1;
+        memcpy(plain[7], msgs[7], sizes[7]);
+        ChaCha20Poly1305OpenBatch(jobs, COUNT);
+        for (int i = 0; i < COUNT; i++) {
+            if (jobs[i].status != ((i == 7) ? -1 : 0) ||
+                    memcmp(msgs[i], plain[i], sizes[i]) != 0) {
+                printf("ChaCha20Poly1305OpenBatch() job %d failed (%s "
+                        "kernel)\n", i, name);
+                return 1;
+            }
+        }
+        for (uint64_t j = 0; j < sizes[7]; j++)
+            plain[7][j] = (uint8_t)(7 * 3 + j);
+    }
+
+    ChaCha20SetKernel(best);
+    for (int i = 0; i < COUNT; i++) {
+        free(msgs[i]);
+        free(plain[i]);
+    }
+    printf("Batched Poly1305 and AEAD passed all tests.\n");
+    return 0;
+}
+
+static int TestParallelAEAD(void) {
+    /* Sizes with a partial last block, whole blocks that are not a multiple
+     * of the chunk alignment, and a multiple of 64 */
+    const uint64_t sizes[] = { 3 * CHACHA20_PARALLEL_MIN + 17,
+        2 * CHACHA20_PARALLEL_MIN + 48, 4 * CHACHA20_PARALLEL_MIN };
+    const uint8_t aad[] = "parallel additional data";
+    uint8_t key[32], nonce[12], tag[16], check[16];
+    for (int i = 0; i < 32; i++)
+        key[i] = (uint8_t)(0x80 + 3 * i);
+    for (int i = 0; i < 12; i++)
+        nonce[i] = (uint8_t)(7 * i);
+
+    uint8_t* plain = malloc(sizes[2]);
+    uint8_t* serial = malloc(sizes[2]);
+    uint8_t* parallel = malloc(sizes[2]);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        const uint64_t size = sizes[s];
+        for (uint64_t i = 0; i < size; i++)
+            plain[i] = (uint8_t)(i * 31 + (i >> 11));
+
+        Poly1305(check, plain, size, key);
+        for (int threads = 0; threads <= 5; threads++) {
+            Poly1305Parallel(tag, plain, size, key, threads);
+            if (memcmp(tag, check, 16) != 0) {
+                printf("Poly1305Parallel() of %llu bytes with %d threads "
+                        "does not match Poly1305()\n",
+                        (unsigned long long)size, threads);
+                return 1;
+            }
+        }
+
+        memcpy(serial, plain, size);
+        ChaCha20Poly1305Seal(serial, size, aad, s * 10, key, nonce, check);
+        for (int threads = 0; threads <= 5; threads++) {
+            memcpy(parallel, plain, size);
+            if (ChaCha20Poly1305SealParallel(parallel, size, aad, s * 10, key,
+                        nonce, tag, threads) != 0 ||
+                    memcmp(tag, check, 16) != 0 ||
+                    memcmp(parallel, serial, size) != 0) {
+                printf("ChaCha20Poly1305SealParallel() of %llu bytes with "
+                        "%d threads does not match ChaCha20Poly1305Seal()\n",
+                        (unsigned long long)size, threads);
+                return 1;
+            }
+
+            // Open puts the ciphertext back for a bad tag
+            check[threads] ^= 1;
+            if (ChaCha20Poly1305OpenParallel(parallel, size, aad, s * 10,
+                        key, nonce, check, threads) != -1 ||
+                    memcmp(parallel, serial, size) != 0) {
+                printf("ChaCha20Poly1305OpenParallel() with %d threads "
+                        "accepted a forged tag\n", threads);
+                return 1;
+            }
+            check[threads] ^= 1;
+
+            if (ChaCha20Poly1305OpenParallel(parallel, size, aad, s * 10,
+                        key, nonce, check, threads) != 0 ||
+                    memcmp(parallel, plain, size) != 0) {
+                printf("ChaCha20Poly1305OpenParallel() of %llu bytes with "
+                        "%d threads failed\n", (unsigned long long)size,
+                        threads);
+                return 1;
+            }
+        }
+    }
+
+    free(plain);
+    free(serial);
+    free(parallel);
+    printf("Parallel Poly1305 and AEAD passed all tests.\n");
+    return 0;
+}
+
 int main() {
+#if defined(__linux__) && !defined(CHACHA20_NO_THREADS)
+    // Before the first use of the thread pool below
+    if (TestThreadPool())
+        return 1;
+#endif
+
     // First make a copy of str because Encrypt() works in place but str cannot
     // be modified as it a const char*
     uint32_t len = strlen(str);
@@ -54,6 +1127,102 @@ int main() {
         return 1;
     } 
 
+    // The SIMD kernels only kick in for longer buffers, so encrypt a long
+    // run of zeros (i.e. produce raw keystream) with the scalar kernel and
+    // check that every kernel produces the same keystream for every length,
+    // each of which takes a different mix of wide and narrow code. The RFC
+    // plaintext must also encrypt to the vector at the start of a long buffer.
+    const char* best = ChaCha20KernelName();
+    const uint32_t big = 4096 + 37;
+    uint8_t* stream = calloc(big, 1);
+    uint8_t* tmp = malloc(big);
+    ChaCha20SetKernel("scalar");
+    Encrypt(stream, big, key, nonce);
+
+    FOR_EACH_KERNEL(name) {
+        memset(tmp, 0, big);
+        memcpy(tmp, str, len);
+        Encrypt(tmp, big, key, nonce);
+        if (memcmp(tmp, ciphertext, len) != 0) {
+            printf("Ciphertext does not match test vector in a long buffer "
+                    "(%s kernel)\n", name);
+            return 1;
+        }
+
+        for (uint32_t n = 1; n < big; n += 61) {
+            memset(tmp, 0, n);
+            Encrypt(tmp, n, key, nonce);
+            if (memcmp(tmp, stream, n) != 0) {
+                printf("Keystream of length %u differs from the scalar one "
+                        "(%s kernel)\n", n, name);
+                return 1;
+            }
+        }
+    }
+
+    ChaCha20SetKernel(best);
+
+    // A context set up once per key must give the same result as Encrypt()
+    ChaCha20Context ctx;
+    ChaCha20Init(&ctx, key, NULL);
+    ChaCha20SetNonce(&ctx, nonce);
+    memset(tmp, 0, big);
+    ChaCha20Encrypt(&ctx, tmp, big);
+    if (memcmp(tmp, stream, big) != 0) {
+        printf("ChaCha20Encrypt() does not match Encrypt()\n");
+        return 1;
+    }
+
+    // Any range of the keystream must be reachable directly
+    for (uint32_t off = 0; off < big; off += 97) {
+        for (uint32_t n = 0; off + n <= big; n += 389) {
+            memset(tmp, 0, n);
+            ChaCha20EncryptAt(&ctx, tmp, n, off);
+            if (memcmp(tmp, stream + off, n) != 0) {
+                printf("ChaCha20EncryptAt() of %u bytes at offset %u does "
+                        "not match the keystream\n", n, off);
+                return 1;
+            }
+        }
+    }
+
+    ChaCha20SetCounter(&ctx, 3);
+    memset(tmp, 0, big - 128);
+    ChaCha20Encrypt(&ctx, tmp, big - 128);
+    if (memcmp(tmp, stream + 128, big - 128) != 0) {
+        printf("ChaCha20SetCounter() does not start at the right block\n");
+        return 1;
+    }
+
+    // The parallel version must not depend on how the buffer is split
+    ChaCha20SetCounter(&ctx, 1);
+    const uint32_t huge = 5 * CHACHA20_PARALLEL_MIN + 17;
+    uint8_t* serial = calloc(huge, 1);
+    uint8_t* parallel = calloc(huge, 1);
+    ChaCha20Encrypt(&ctx, serial, huge);
+    for (int threads = 0; threads <= 7; threads++) {
+        memset(parallel, 0, huge);
+        ChaCha20EncryptParallel(&ctx, parallel, huge, threads);
+        if (memcmp(parallel, serial, huge) != 0) {
+            printf("ChaCha20EncryptParallel() with %d threads does not match "
+                    "ChaCha20Encrypt()\n", threads);
+            return 1;
+        }
+    }
+
+    free(serial);
+    free(parallel);
+    free(stream);
+    free(tmp);
+    free(data);
     printf("ChaCha20 passed all tests.\n"); 
-    return 0;
+    if (TestCounter64() || TestReducedRounds() || TestStream() ||
+            TestEncryptTo() || TestPoly1305() || TestAEAD() ||
+            TestXChaCha20())
+        return 1;
+#ifndef CHACHA20_NO_IOVEC
+    if (TestIOV())
+        return 1;
+#endif
+    return TestMultiBuffer() || TestBatch() || TestParallelAEAD();
 }